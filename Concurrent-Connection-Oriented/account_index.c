@@ -0,0 +1,188 @@
+/*
+ * account_index.c
+ * Open-addressing (linear probing) hash index keyed by account number.
+ *
+ * Slots live in one contiguous array, so a lookup is a hash, one cache
+ * line for the home slot and, at our load factor, rarely a second one.
+ * Deletion uses backward-shift instead of tombstones, so probe chains
+ * never get longer because of CLOSE churn.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "account_index.h"
+
+#define MIN_CAPACITY  16
+
+// Grow once the table is more than 70% full
+#define MAX_LOAD_NUM  7
+#define MAX_LOAD_DEN  10
+
+// A table grow() replaced. Concurrent lookups may still be probing it, so it
+// is only freed by index_destroy(); each is half the size of the next, so
+// together they take less than the live table.
+typedef struct RetiredTable {
+    struct RetiredTable *next;
+    IndexSlot           *slots;
+} RetiredTable;
+
+//
+// Fibonacci hashing: account numbers are handed out sequentially, so
+// multiply to spread neighbours over the whole table.
+//
+static size_t home_slot(size_t capacity, int key) {
+    uint64_t h = (uint64_t)(uint32_t)key * 0x9E3779B97F4A7C15ull;
+    return (size_t)(h >> 32) & (capacity - 1);
+}
+
+static size_t round_up_pow2(size_t n) {
+    size_t cap = MIN_CAPACITY;
+    while (cap < n) cap <<= 1;
+    return cap;
+}
+
+int index_init(AccountIndex *ix, size_t capacity) {
+    ix->capacity = round_up_pow2(capacity);
+    ix->count    = 0;
+    ix->slots    = calloc(ix->capacity, sizeof(IndexSlot));
+    ix->fixed    = 0;
+    ix->retired  = NULL;
+    return ix->slots ? 0 : -1;
+}
+
+//
+// Use caller-provided, zeroed storage (e.g. a shared mapping). The table
+// cannot be reallocated, so index_insert() fails once it is full.
+//
+void index_init_fixed(AccountIndex *ix, IndexSlot *slots, size_t capacity) {
+    ix->capacity = capacity;
+    ix->count    = 0;
+    ix->slots    = slots;
+    ix->fixed    = 1;
+    ix->retired  = NULL;
+}
+
+// Number of slots (a power of two) that holds max_entries under the load limit
+size_t index_slots_for(size_t max_entries) {
+    return round_up_pow2(max_entries * MAX_LOAD_DEN / MAX_LOAD_NUM + 1);
+}
+
+void index_destroy(AccountIndex *ix) {
+    if (!ix->fixed) free(ix->slots);
+    while (ix->retired) {
+        RetiredTable *r = ix->retired;
+        ix->retired = r->next;
+        free(r->slots);
+        free(r);
+    }
+    ix->slots    = NULL;
+    ix->capacity = 0;
+    ix->count    = 0;
+}
+
+struct Account *index_lookup(const AccountIndex *ix, int key) {
+    if (!ix->slots || key == 0) return NULL;
+    size_t mask = ix->capacity - 1;
+    for (size_t i = home_slot(ix->capacity, key); ; i = (i + 1) & mask) {
+        const IndexSlot *s = &ix->slots[i];
+        if (s->key == key) return s->acc;
+        if (s->key == 0)   return NULL;
+    }
+}
+
+//
+// The capacity is read before the table and grow() publishes them the other
+// way round, so the capacity used is never larger than the table probed.
+// Whatever a concurrent remove leaves in the slots, the probe stops after
+// one pass over the table.
+//
+struct Account *index_lookup_concurrent(const AccountIndex *ix, int key) {
+    size_t capacity = __atomic_load_n(&ix->capacity, __ATOMIC_ACQUIRE);
+    const IndexSlot *slots = __atomic_load_n(&ix->slots, __ATOMIC_ACQUIRE);
+    if (!slots || capacity == 0 || key == 0) return NULL;
+    size_t mask = capacity - 1;
+    size_t i = home_slot(capacity, key);
+    for (size_t probes = 0; probes < capacity; probes++, i = (i + 1) & mask) {
+        int k = __atomic_load_n(&slots[i].key, __ATOMIC_RELAXED);
+        if (k == key) return __atomic_load_n(&slots[i].acc, __ATOMIC_RELAXED);
+        if (k == 0)   return NULL;
+    }
+    return NULL;
+}
+
+//
+// Every slot write goes through here: index_lookup_concurrent() reads the
+// same fields with atomic loads, and a plain store racing with those would
+// be undefined even though the seqlock discards the answer.
+//
+static void set_slot(IndexSlot *s, int key, struct Account *acc) {
+    __atomic_store_n(&s->key, key, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->acc, acc, __ATOMIC_RELAXED);
+}
+
+// Insert without a load check; caller guarantees a free slot exists
+static void place(AccountIndex *ix, int key, struct Account *acc) {
+    size_t mask = ix->capacity - 1;
+    size_t i = home_slot(ix->capacity, key);
+    while (ix->slots[i].key != 0 && ix->slots[i].key != key)
+        i = (i + 1) & mask;
+    if (ix->slots[i].key == 0) ix->count++;
+    set_slot(&ix->slots[i], key, acc);
+}
+
+static int grow(AccountIndex *ix) {
+    AccountIndex bigger;
+    RetiredTable *old = malloc(sizeof(RetiredTable));
+    if (!old || index_init(&bigger, ix->capacity * 2) < 0) {
+        free(old);
+        return -1;
+    }
+    for (size_t i = 0; i < ix->capacity; i++) {
+        if (ix->slots[i].key != 0)
+            place(&bigger, ix->slots[i].key, ix->slots[i].acc);
+    }
+    old->slots = ix->slots;
+    old->next  = ix->retired;
+    ix->retired = old;
+    ix->count   = bigger.count;
+    __atomic_store_n(&ix->slots, bigger.slots, __ATOMIC_RELEASE);
+    __atomic_store_n(&ix->capacity, bigger.capacity, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int index_insert(AccountIndex *ix, int key, struct Account *acc) {
+    if (key == 0) return -1;
+    if (!ix->slots && index_init(ix, MIN_CAPACITY) < 0) return -1;
+    if ((ix->count + 1) * MAX_LOAD_DEN > ix->capacity * MAX_LOAD_NUM) {
+        if (ix->fixed || grow(ix) < 0) return -1;
+    }
+    place(ix, key, acc);
+    return 0;
+}
+
+struct Account *index_remove(AccountIndex *ix, int key) {
+    if (!ix->slots || key == 0) return NULL;
+    size_t mask = ix->capacity - 1;
+    size_t i = home_slot(ix->capacity, key);
+    while (ix->slots[i].key != key) {
+        if (ix->slots[i].key == 0) return NULL;
+        i = (i + 1) & mask;
+    }
+    struct Account *acc = ix->slots[i].acc;
+
+    // Backward-shift: pull later members of the probe chain into the hole
+    // whenever their home slot does not lie cyclically in (hole, j].
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; ix->slots[j].key != 0; j = (j + 1) & mask) {
+        size_t home = home_slot(ix->capacity, ix->slots[j].key);
+        int stays = (hole <= j) ? (hole < home && home <= j)
+                                : (hole < home || home <= j);
+        if (!stays) {
+            set_slot(&ix->slots[hole], ix->slots[j].key, ix->slots[j].acc);
+            hole = j;
+        }
+    }
+    set_slot(&ix->slots[hole], 0, NULL);
+    ix->count--;
+    return acc;
+}
@@ -0,0 +1,42 @@
+/*
+ * account_index.h
+ * Open-addressing hash index: account_number -> Account*
+ */
+
+#ifndef ACCOUNT_INDEX_H
+#define ACCOUNT_INDEX_H
+
+#include <stddef.h>
+
+struct Account;
+
+// One slot of the table. key == 0 marks an empty slot
+// (account numbers start at 1001, so 0 is never a real key).
+typedef struct IndexSlot {
+    int             key;
+    struct Account *acc;
+} IndexSlot;
+
+typedef struct AccountIndex {
+    size_t     capacity;   // always a power of two
+    size_t     count;
+    IndexSlot *slots;      // contiguous, linear probing
+    int        fixed;      // caller-owned storage: never grows or frees
+    struct RetiredTable *retired;   // outgrown tables, kept for concurrent lookups
+} AccountIndex;
+
+int             index_init(AccountIndex *ix, size_t capacity);
+void            index_init_fixed(AccountIndex *ix, IndexSlot *slots, size_t capacity);
+size_t          index_slots_for(size_t max_entries);
+void            index_destroy(AccountIndex *ix);
+struct Account *index_lookup(const AccountIndex *ix, int key);
+int             index_insert(AccountIndex *ix, int key, struct Account *acc);
+struct Account *index_remove(AccountIndex *ix, int key);
+
+// Lookup that may run while another thread inserts, removes or grows. It
+// never reads outside a table (tables replaced by growing are kept until
+// index_destroy()), but its answer is only right if no change overlapped
+// it: the caller has to detect that (ledger.h, index_seq).
+struct Account *index_lookup_concurrent(const AccountIndex *ix, int key);
+
+#endif // ACCOUNT_INDEX_H
@@ -0,0 +1,117 @@
+/*
+ * auth.c
+ * PIN generation, hashing and checking.
+ *
+ * Accounts keep SHA-256(salt || PIN) with a per-account random salt, never
+ * the PIN itself, so neither the ledger, a snapshot nor the log gives PINs
+ * away. The hash is a single round on purpose: with only 9000 possible PINs
+ * no affordable stretching would stop an offline search, it would only slow
+ * down every request. What the salt buys is that equal PINs do not look
+ * equal, and nothing can be precomputed across accounts.
+ *
+ * Checking compares all 32 bytes whatever they hold, and an unknown account
+ * costs the same hash as a wrong PIN. A connection remembers the pairs it
+ * has proven (AuthCache), so a client working one account pays for the hash
+ * once and then only for an integer compare, without touching the account's
+ * cold record.
+ */
+
+#include <errno.h>
+#include <sys/random.h>
+#include "auth.h"
+
+static __thread AuthCache *session;
+
+// Fill buf from the kernel CSPRNG (thread-safe, unlike rand()); 0 or -1
+static int random_bytes(void *buf, size_t len) {
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = getrandom(p, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void hash_pin(const uint8_t salt[PIN_SALT_LEN], int pin, uint8_t out[SHA256_LEN]) {
+    uint32_t v = (uint32_t)pin;
+    uint8_t le[4] = { (uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24) };
+    Sha256 s;
+    sha256_init(&s);
+    sha256_update(&s, salt, PIN_SALT_LEN);
+    sha256_update(&s, le, sizeof(le));
+    sha256_final(&s, out);
+}
+
+//
+// A uniformly random 4-digit PIN (1000-9999), or -1 if the kernel would not
+// provide randomness.
+//
+int pin_generate(void) {
+    // 63000 is the largest multiple of 9000 below 2^16: reject above it
+    uint16_t v;
+    do {
+        if (random_bytes(&v, sizeof(v)) < 0) return -1;
+    } while (v >= 63000);
+    return 1000 + v % 9000;
+}
+
+// Store `pin` under a fresh salt; 0, or -1 without randomness
+int pin_set(PinHash *h, int pin) {
+    if (random_bytes(h->salt, sizeof(h->salt)) < 0) return -1;
+    hash_pin(h->salt, pin, h->hash);
+    return 0;
+}
+
+// Constant time in the PIN and the stored hash
+int pin_matches(const PinHash *h, int pin) {
+    uint8_t digest[SHA256_LEN];
+    hash_pin(h->salt, pin, digest);
+    uint8_t diff = 0;
+    for (int i = 0; i < SHA256_LEN; i++) diff |= digest[i] ^ h->hash[i];
+    return diff == 0;
+}
+
+void auth_bind_session(AuthCache *cache) {
+    session = cache;
+}
+
+const AuthCache *auth_session(void) {
+    return session;
+}
+
+//
+// Is `pin` right for `acct_no`, whose stored hash is `h` (NULL: no such
+// account, which always fails)? Answered from the bound session's cache when
+// it has the account, else by hashing; the cache is left alone.
+//
+int auth_check(int acct_no, int pin, const PinHash *h) {
+    static const PinHash no_account;
+    const AuthCache *c = session;
+
+    if (c) {
+        for (uint32_t i = 0; i < c->used; i++)
+            if (c->slot[i].acct_no == acct_no)
+                return ((uint32_t)c->slot[i].pin ^ (uint32_t)pin) == 0 ? AUTH_CACHED : 0;
+    }
+    return (pin_matches(h ? h : &no_account, pin) & (h != NULL)) ? AUTH_HASHED : 0;
+}
+
+void auth_remember(int acct_no, int pin) {
+    AuthCache *c = session;
+    if (!c) return;
+    uint32_t i = c->used < AUTH_CACHE_SLOTS ? c->used++ : c->next++ % AUTH_CACHE_SLOTS;
+    c->slot[i].acct_no = acct_no;
+    c->slot[i].pin     = pin;
+}
+
+// auth_check(), and a hashed success is added to the cache
+int auth_verify(int acct_no, int pin, const PinHash *h) {
+    int r = auth_check(acct_no, pin, h);
+    if (r == AUTH_HASHED) auth_remember(acct_no, pin);
+    return r != 0;
+}
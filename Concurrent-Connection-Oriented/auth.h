@@ -0,0 +1,59 @@
+/*
+ * auth.h
+ * Salted PIN hashes, constant-time PIN checks and what a connection has proven:
+ * its auth cache and its LOGIN
+ */
+
+#ifndef AUTH_H
+#define AUTH_H
+
+#include <stdint.h>
+#include "sha256.h"
+
+#define PIN_SALT_LEN     16
+#define AUTH_CACHE_SLOTS  4   // accounts a connection keeps authenticated
+
+// What an account stores instead of its PIN: SHA-256(salt || PIN)
+typedef struct PinHash {
+    uint8_t salt[PIN_SALT_LEN];
+    uint8_t hash[SHA256_LEN];
+} PinHash;
+
+struct Account;
+
+// (account, PIN) pairs this connection has already proven. A request naming
+// one of them is checked against the cache instead of the account's hash.
+// After LOGIN, requests name no account at all and act on `login`, which
+// stays valid while the record's generation is the one seen at login.
+typedef struct AuthCache {
+    struct {
+        int32_t acct_no;
+        int32_t pin;
+    } slot[AUTH_CACHE_SLOTS];
+    uint32_t used;            // slots filled
+    uint32_t next;            // slot the next new entry replaces
+
+    struct Account *login;    // NULL: not logged in
+    int32_t  login_acct;
+    uint32_t login_generation;
+} AuthCache;
+
+int  pin_generate(void);
+int  pin_set(PinHash *h, int pin);
+int  pin_matches(const PinHash *h, int pin);
+
+// Bind the cache of the connection whose request this thread is processing
+// (NULL: none, every check hashes)
+void auth_bind_session(AuthCache *cache);
+const AuthCache *auth_session(void);
+int  auth_verify(int acct_no, int pin, const PinHash *h);
+
+// The two halves of auth_verify(), for a caller that learns only afterwards
+// whether `h` really was the account's (a lock-free read): auth_check() never
+// touches the cache, and auth_remember() adds a pair it has since confirmed.
+#define AUTH_CACHED  1   // proven earlier on this connection
+#define AUTH_HASHED  2   // matched `h`
+int  auth_check(int acct_no, int pin, const PinHash *h);
+void auth_remember(int acct_no, int pin);
+
+#endif // AUTH_H
@@ -0,0 +1,419 @@
+/*
+ * bank_bench.c
+ * Load generator: K concurrent connections drive a weighted mix of commands
+ * against any of the servers and report throughput and latency percentiles.
+ *
+ *   ./bank_bench 127.0.0.1 -c 64 -d 10              closed loop, one request
+ *                                                   in flight per connection
+ *   ./bank_bench 127.0.0.1 -c 64 -p 16              closed loop, 16 in flight
+ *   ./bank_bench 127.0.0.1 -c 64 -r 50000           open loop, 50k requests/s
+ *   ./bank_bench 127.0.0.1 -m balance=80,deposit=20 command mix (weights)
+ *
+ * Closed loop: every connection keeps `depth` requests in flight and sends
+ * the next one as soon as a reply arrives; latency is send to reply. Open
+ * loop: every connection sends on a fixed schedule whether or not replies
+ * keep up, and latency counts from when a request was due rather than when
+ * it went out, so a stalled server shows up in the tail instead of quietly
+ * slowing the load down (coordinated omission).
+ *
+ * Setup opens and funds -a accounts, spread over the connections, and every
+ * connection then picks accounts from the whole set. Run bank_server with
+ * -s, or its children will not see each other's accounts.
+ */
+
+#define _GNU_SOURCE          // ppoll()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "connection.h"
+#include "histogram.h"
+
+#define PORT              3333
+#define DEFAULT_CONNS     16
+#define DEFAULT_SECS      10
+#define DEFAULT_ACCOUNTS  1000
+#define DEFAULT_MIX       "balance=50,deposit=20,withdraw=20,statement=9,open=1"
+#define MAX_INFLIGHT      256      // per connection; keeps our writes from blocking
+#define SETUP_CHUNK       MAX_INFLIGHT
+#define REQUEST_MAX       64       // longest request line we format
+#define AMOUNT            500      // the server's minimum deposit / withdrawal
+#define FUNDING           1000000  // deposited into every account at setup
+#define DRAIN_SECS        5        // wait this long for replies after the run
+
+enum Op { OP_OPEN, OP_DEPOSIT, OP_WITHDRAW, OP_BALANCE, OP_STATEMENT, OP_COUNT };
+
+static const char *op_names[OP_COUNT] = { "OPEN", "DEPOSIT", "WITHDRAW", "BALANCE", "STATEMENT" };
+
+static struct {
+    struct sockaddr_in addr;
+    int      conns;
+    int      depth;               // closed loop: requests in flight per connection
+    int      accounts;
+    double   secs;
+    double   rate;                // open loop: requests/s over all connections; 0 = closed
+    unsigned weight[OP_COUNT];
+    unsigned weight_total;
+} cfg;
+
+static int *acct_no, *acct_pin;   // the accounts set up for the run
+static pthread_barrier_t start_barrier;
+
+typedef struct Worker {
+    pthread_t  thread;
+    int        id;
+    int        fd;
+    unsigned   seed;
+    int        failed;
+    Connection conn;
+    uint64_t   errors[OP_COUNT];
+    uint64_t   unsent;            // open loop: fell due, never sent (in-flight limit)
+    Histogram  latency[OP_COUNT]; // ns
+} Worker;
+
+// Requests sent and not yet answered, oldest first (replies come in order)
+typedef struct InFlight {
+    uint64_t since[MAX_INFLIGHT]; // send time (closed loop) or due time (open)
+    uint8_t  op[MAX_INFLIGHT];
+    int      head;
+    int      count;
+} InFlight;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Next reply line, waiting for it; NULL once the server has closed
+static char *next_reply_line(Connection *conn) {
+    char *line;
+    while (1) {
+        int r = conn_next_line(conn, &line);
+        if (r == CONN_LINE) return line;
+        if (r == CONN_NEED_MORE && conn_fill(conn) <= 0) return NULL;
+    }
+}
+
+static int connect_server(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&cfg.addr, sizeof(cfg.addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//
+// Open and fund this worker's share of the accounts, SETUP_CHUNK at a time
+// pipelined. Returns 0, or -1 if the server refused or went away.
+//
+static int setup_accounts(Worker *w) {
+    int lo = (int)((long)cfg.accounts * w->id / cfg.conns);
+    int hi = (int)((long)cfg.accounts * (w->id + 1) / cfg.conns);
+    static __thread char out[SETUP_CHUNK * REQUEST_MAX];
+
+    for (int first = lo; first < hi; first += SETUP_CHUNK) {
+        int n = hi - first < SETUP_CHUNK ? hi - first : SETUP_CHUNK;
+        size_t len = 0;
+        for (int i = 0; i < n; i++)
+            len += sprintf(out + len, "OPEN bench %d savings\n", first + i);
+        if (write_all(w->fd, out, len) < 0) return -1;
+        for (int i = 0; i < n; i++) {
+            char *line = next_reply_line(&w->conn);
+            if (!line || sscanf(line, "OK %d %d", &acct_no[first + i], &acct_pin[first + i]) != 2)
+                return -1;
+        }
+
+        len = 0;
+        for (int i = 0; i < n; i++)
+            len += sprintf(out + len, "DEPOSIT %d %d %d\n",
+                           acct_no[first + i], acct_pin[first + i], FUNDING);
+        if (write_all(w->fd, out, len) < 0) return -1;
+        for (int i = 0; i < n; i++) {
+            char *line = next_reply_line(&w->conn);
+            if (!line || strncmp(line, "OK", 2) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+static int pick_op(unsigned *seed) {
+    unsigned r = rand_r(seed) % cfg.weight_total;
+    int op = 0;
+    while (r >= cfg.weight[op]) r -= cfg.weight[op++];
+    return op;
+}
+
+static size_t format_request(char *p, int op, unsigned *seed) {
+    int k = rand_r(seed) % cfg.accounts;
+    switch (op) {
+    case OP_OPEN:      return sprintf(p, "OPEN bench %d savings\n", k);
+    case OP_DEPOSIT:   return sprintf(p, "DEPOSIT %d %d %d\n", acct_no[k], acct_pin[k], AMOUNT);
+    case OP_WITHDRAW:  return sprintf(p, "WITHDRAW %d %d %d\n", acct_no[k], acct_pin[k], AMOUNT);
+    case OP_BALANCE:   return sprintf(p, "BALANCE %d %d\n", acct_no[k], acct_pin[k]);
+    default:           return sprintf(p, "STATEMENT %d %d\n", acct_no[k], acct_pin[k]);
+    }
+}
+
+//
+// Take every complete reply out of the input buffer and record its latency.
+// A STATEMENT reply is complete after its "OK <n>" line and n entries;
+// *body counts the entry lines still to come. Returns -1 on a reply nobody
+// asked for.
+//
+static int collect_replies(Worker *w, InFlight *f, int *body) {
+    char *line;
+    while (conn_next_line(&w->conn, &line) == CONN_LINE) {
+        if (*body > 0) {
+            if (--*body > 0) continue;   // the last entry completes the STATEMENT
+        } else {
+            if (f->count == 0) return -1;
+            int op = f->op[f->head];
+            int n = 0;
+            if (strncmp(line, "OK", 2) != 0) w->errors[op]++;
+            else if (op == OP_STATEMENT && sscanf(line, "OK %d", &n) == 1 && n > 0) {
+                *body = n;
+                continue;
+            }
+        }
+        hist_record(&w->latency[f->op[f->head]], now_ns() - f->since[f->head]);
+        f->head = (f->head + 1) % MAX_INFLIGHT;
+        f->count--;
+    }
+    return 0;
+}
+
+//
+// The measured run: send what the loop discipline allows, then wait for
+// replies (or, open loop, for the next request to fall due), for cfg.secs;
+// then wait for the replies still outstanding.
+//
+static int run_load(Worker *w) {
+    static __thread InFlight f;
+    static __thread char out[MAX_INFLIGHT * REQUEST_MAX];
+    int body = 0;
+    int open_loop = cfg.rate > 0;
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(cfg.secs * 1e9);
+    double interval = open_loop ? cfg.conns / cfg.rate * 1e9 : 0;
+    double next_due = start + interval * w->id / cfg.conns;   // stagger the schedules
+
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= end + DRAIN_SECS * 1000000000ull) return -1;   // replies lost
+        if (now >= end && f.count == 0) {
+            if (open_loop)
+                for (; next_due < end; next_due += interval) w->unsent++;
+            return 0;
+        }
+
+        size_t len = 0;
+        while (now < end && f.count < MAX_INFLIGHT) {
+            uint64_t since;
+            if (open_loop) {
+                if (next_due > now) break;
+                since = (uint64_t)next_due;
+                next_due += interval;
+            } else {
+                if (f.count >= cfg.depth) break;
+                since = now;
+            }
+            int op = pick_op(&w->seed);
+            int slot = (f.head + f.count++) % MAX_INFLIGHT;
+            f.since[slot] = since;
+            f.op[slot] = (uint8_t)op;
+            len += format_request(out + len, op, &w->seed);
+        }
+        if (len && write_all(w->fd, out, len) < 0) return -1;
+
+        // Sleep until a reply arrives, or the next request is due
+        uint64_t wake = end + DRAIN_SECS * 1000000000ull;
+        if (open_loop && now < end && next_due < wake) wake = (uint64_t)next_due;
+        now = now_ns();
+        uint64_t wait = wake > now ? wake - now : 0;
+        struct timespec ts = { .tv_sec = wait / 1000000000u, .tv_nsec = wait % 1000000000u };
+        struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+        int r = ppoll(&pfd, 1, &ts, NULL);
+        if (r < 0 && errno != EINTR) return -1;
+        if (r > 0) {
+            if (conn_fill(&w->conn) <= 0) return -1;
+            if (collect_replies(w, &f, &body) < 0) return -1;
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+    w->fd = connect_server();
+    if (w->fd < 0) w->failed = 1;
+    else {
+        conn_init(&w->conn, w->fd);
+        if (setup_accounts(w) < 0) w->failed = 1;
+    }
+
+    pthread_barrier_wait(&start_barrier);   // everybody's accounts exist
+    pthread_barrier_wait(&start_barrier);   // main checked that setup worked
+    if (!w->failed && run_load(w) < 0) w->failed = 1;
+
+    if (w->fd >= 0) {
+        write_all(w->fd, "QUIT\n", 5);
+        close(w->fd);
+        conn_destroy(&w->conn);
+    }
+    return NULL;
+}
+
+static void print_row(const char *name, const Histogram *h, uint64_t errors, double secs) {
+    printf("%-10s %10llu %10.0f %8llu %9.1f %9.1f %9.1f %9.1f\n",
+           name, (unsigned long long)h->count, h->count / secs, (unsigned long long)errors,
+           hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3,
+           hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+}
+
+// "balance=60,deposit=40": weights by command name; unnamed commands get 0
+static int parse_mix(const char *spec) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    memset(cfg.weight, 0, sizeof(cfg.weight));
+    cfg.weight_total = 0;
+    for (char *save, *item = strtok_r(buf, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        if (!eq) return -1;
+        *eq = '\0';
+        int op = 0;
+        while (op < OP_COUNT && strcasecmp(item, op_names[op]) != 0) op++;
+        if (op == OP_COUNT) return -1;
+        cfg.weight[op] = (unsigned)atoi(eq + 1);
+        cfg.weight_total += cfg.weight[op];
+    }
+    return cfg.weight_total > 0 ? 0 : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s <server-ip> [-c conns] [-d secs] [-a accounts]\n"
+                    "       [-m mix] [-p depth | -r rate]\n"
+                    "  -c  concurrent connections (default %d)\n"
+                    "  -d  seconds of load (default %d)\n"
+                    "  -a  accounts opened and funded at setup (default %d)\n"
+                    "  -m  weighted command mix (default %s)\n"
+                    "  -p  closed loop: requests in flight per connection (default 1, max %d)\n"
+                    "  -r  open loop: requests per second over all connections\n",
+            prog, DEFAULT_CONNS, DEFAULT_SECS, DEFAULT_ACCOUNTS, DEFAULT_MIX, MAX_INFLIGHT);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *mix = DEFAULT_MIX;
+    cfg.conns    = DEFAULT_CONNS;
+    cfg.secs     = DEFAULT_SECS;
+    cfg.accounts = DEFAULT_ACCOUNTS;
+    cfg.depth    = 1;
+    int opt_ch;
+    while ((opt_ch = getopt(argc, argv, "c:d:a:m:p:r:")) != -1) {
+        switch (opt_ch) {
+            case 'c': cfg.conns    = atoi(optarg); break;
+            case 'd': cfg.secs     = atof(optarg); break;
+            case 'a': cfg.accounts = atoi(optarg); break;
+            case 'm': mix          = optarg; break;
+            case 'p': cfg.depth    = atoi(optarg); break;
+            case 'r': cfg.rate     = atof(optarg); break;
+            default:  usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || cfg.conns < 1 || cfg.secs <= 0 || cfg.accounts < 1 ||
+        cfg.depth < 1 || cfg.depth > MAX_INFLIGHT || cfg.rate < 0 || parse_mix(mix) < 0)
+        usage(argv[0]);
+
+    cfg.addr.sin_family = AF_INET;
+    cfg.addr.sin_port   = htons(PORT);
+    if (inet_pton(AF_INET, argv[optind], &cfg.addr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid IP address: %s\n", argv[optind]);
+        exit(1);
+    }
+
+    acct_no  = calloc(cfg.accounts, sizeof(int));
+    acct_pin = calloc(cfg.accounts, sizeof(int));
+    Worker *workers = calloc(cfg.conns, sizeof(Worker));
+    if (!acct_no || !acct_pin || !workers) {
+        perror("calloc");
+        exit(1);
+    }
+    pthread_barrier_init(&start_barrier, NULL, cfg.conns + 1);
+    for (int i = 0; i < cfg.conns; i++) {
+        workers[i].id   = i;
+        workers[i].fd   = -1;
+        workers[i].seed = 0x9e3779b9u * (i + 1);
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    for (int i = 0; i < cfg.conns; i++) {
+        if (workers[i].failed) {
+            fprintf(stderr, "setup failed (server not running, or refusing OPEN?)\n");
+            exit(1);
+        }
+    }
+    uint64_t t0 = now_ns();
+    pthread_barrier_wait(&start_barrier);
+    for (int i = 0; i < cfg.conns; i++) pthread_join(workers[i].thread, NULL);
+    double secs = (now_ns() - t0) / 1e9;
+
+    static Histogram per_op[OP_COUNT], all;
+    uint64_t errors[OP_COUNT] = { 0 }, all_errors = 0, unsent = 0;
+    int failed = 0;
+    for (int i = 0; i < cfg.conns; i++) {
+        failed += workers[i].failed;
+        unsent += workers[i].unsent;
+        for (int op = 0; op < OP_COUNT; op++) {
+            hist_merge(&per_op[op], &workers[i].latency[op]);
+            errors[op] += workers[i].errors[op];
+        }
+    }
+
+    if (cfg.rate > 0)
+        printf("%d connections, open loop at %.0f requests/s, %.1f s, %d accounts\n",
+               cfg.conns, cfg.rate, secs, cfg.accounts);
+    else
+        printf("%d connections, closed loop with %d in flight each, %.1f s, %d accounts\n",
+               cfg.conns, cfg.depth, secs, cfg.accounts);
+    printf("%-10s %10s %10s %8s %9s %9s %9s %9s\n",
+           "command", "ops", "ops/s", "errors", "p50 us", "p99 us", "p99.9 us", "max us");
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (per_op[op].count == 0) continue;
+        print_row(op_names[op], &per_op[op], errors[op], secs);
+        hist_merge(&all, &per_op[op]);
+        all_errors += errors[op];
+    }
+    print_row("all", &all, all_errors, secs);
+    if (unsent)
+        printf("%llu requests fell due but were never sent: the server did not keep up\n",
+               (unsigned long long)unsent);
+    if (failed) fprintf(stderr, "%d connections failed during the run\n", failed);
+    return failed ? 1 : 0;
+}
@@ -1,20 +1,258 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>          // read(), write(), close()
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>       // inet_pton()
 #include <netinet/in.h>      // sockaddr_in
+#include "connection.h"
 
 #define PORT   3333
 #define BUF_SZ 256
+#define DEFAULT_WINDOW  64
+#define MAX_WINDOW      4096
+#define MAX_GROUP       1024    // the server's BATCH_MAX
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Next reply line from the server; NULL once the server has closed
+static char *next_reply_line(Connection *conn) {
+    char *line;
+    while (1) {
+        int r = conn_next_line(conn, &line);
+        if (r == CONN_LINE) return line;
+        if (r == CONN_NEED_MORE && conn_fill(conn) <= 0) return NULL;
+    }
+}
+
+// STATEMENT, PAGE and STATS replies run over several lines
+static int is_multiline(const char *cmd) {
+    return strncmp(cmd, "STATEMENT", 9) == 0 || strncmp(cmd, "PAGE", 4) == 0 ||
+           strncmp(cmd, "STATS", 5) == 0;
+}
+
+static int is_quit(const char *cmd) {
+    return strncmp(cmd, "QUIT", 4) == 0;
+}
+
+//
+// Read and print one complete reply. Every command gets exactly one reply
+// line, except a successful STATEMENT, PAGE or STATS: "OK <n>" followed by n lines.
+// Returns 0, or -1 if the server closed the connection.
+//
+static int print_reply(Connection *conn, int multiline, const char *prefix) {
+    char *line = next_reply_line(conn);
+    if (!line) return -1;
+    printf("%s%s\n", prefix, line);
+
+    int extra = 0;
+    if (multiline && sscanf(line, "OK %d", &extra) == 1) {
+        for (int i = 0; i < extra; i++) {
+            if (!(line = next_reply_line(conn))) return -1;
+            printf("%s%s\n", prefix, line);
+        }
+    }
+    return 0;
+}
+
+//
+// Interactive mode: one command, wait for its reply, repeat (inside BATCH,
+// the reply waits for EXEC).
+//
+static void run_interactive(int sock_fd, Connection *conn) {
+    char line[BUF_SZ];
+    int in_batch = 0;
+    while (1) {
+        printf("bank> ");
+        fflush(stdout);
+        if (!fgets(line, BUF_SZ, stdin)) break;  // EOF on stdin
+
+        if (write_all(sock_fd, line, strlen(line)) < 0) break;
+
+        // If command was QUIT, exit
+        if (is_quit(line)) break;
+
+        // BATCH and the lines queued after it get no reply; EXEC answers for all
+        if (strncmp(line, "BATCH", 5) == 0) {
+            in_batch = 1;
+            continue;
+        }
+        if (in_batch && strncmp(line, "EXEC", 4) != 0) {
+            printf("  .. queued\n");
+            continue;
+        }
+        in_batch = 0;
+
+        if (print_reply(conn, is_multiline(line), "  -> ") < 0) break;  // server closed
+    }
+}
+
+static int is_batchable(const char *cmd) {
+    return strncmp(cmd, "DEPOSIT ", 8) == 0 || strncmp(cmd, "WITHDRAW ", 9) == 0;
+}
+
+// Commands of the current burst, written with one write() once full or done
+typedef struct Burst {
+    int    fd;
+    size_t len;
+    char   buf[MAX_WINDOW * 64];
+} Burst;
+
+static int burst_add(Burst *b, const char *line, size_t len) {
+    if (b->len + len > sizeof(b->buf)) {
+        if (write_all(b->fd, b->buf, b->len) < 0) return -1;
+        b->len = 0;
+    }
+    memcpy(b->buf + b->len, line, len);
+    b->len += len;
+    return 0;
+}
+
+//
+// Batch mode: stream commands from `in`, keeping up to `window` requests in
+// flight. Commands are written in bursts (one write() per burst) and the
+// replies, which the server sends in request order, are matched back to them
+// FIFO. Each reply line goes to stdout as-is.
+//
+// Lines between BATCH and EXEC get no reply of their own (EXEC answers for
+// all of them). With group > 0, runs of DEPOSIT / WITHDRAW lines are wrapped
+// in BATCH ... EXEC blocks of up to `group` ops automatically. The window
+// counts operations, not replies, so batching never queues more work than
+// plain pipelining would.
+//
+typedef struct InFlight {
+    unsigned char multiline;   // reply may carry more lines (STATEMENT, STATS)
+    int           ops;         // operations it answers for
+} InFlight;
+
+// Replies still to come, oldest at head
+typedef struct Pending {
+    InFlight ring[MAX_WINDOW];
+    int      head, count;
+    int      load;             // sum of their ops
+} Pending;
+
+static void expect_reply(Pending *p, int multiline, int ops) {
+    p->ring[(p->head + p->count++) % MAX_WINDOW] = (InFlight){ multiline, ops };
+    p->load += ops;
+}
+
+// Close the BATCH opened for -B; EXEC's one reply answers for all its ops
+static int end_group(Burst *out, Pending *p, int *grouped) {
+    if (*grouped == 0) return 0;
+    if (burst_add(out, "EXEC\n", 5) < 0) return -1;
+    expect_reply(p, 0, *grouped);
+    *grouped = 0;
+    return 0;
+}
+
+static int run_batch(int sock_fd, Connection *conn, FILE *in, int window, int group) {
+    static Pending pend;
+    static Burst out;
+    int eof = 0, quit = 0;
+    int in_batch = 0;    // ops inside a BATCH the input itself opened
+    int grouped  = 0;    // ops in the BATCH we opened for `group`
+    long sent = 0;
+    char line[CONN_IN_SZ];
+    out.fd  = sock_fd;
+    out.len = 0;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    while (1) {
+        // Top up the window, then send the whole burst at once
+        while (!eof && pend.load + grouped + in_batch < window) {
+            if (!fgets(line, sizeof(line), in)) { eof = 1; break; }
+            size_t len = strcspn(line, "\r\n");
+            if (len == 0) continue;
+            line[len] = '\0';
+            int batchable = group > 0 && !in_batch && is_batchable(line);
+
+            if (!batchable && end_group(&out, &pend, &grouped) < 0) return -1;
+            line[len++] = '\n';
+            if (batchable && grouped == 0 && burst_add(&out, "BATCH\n", 6) < 0) return -1;
+            if (burst_add(&out, line, len) < 0) return -1;
+            if (is_quit(line)) { eof = quit = 1; break; }  // no reply follows
+            sent++;
+            if (batchable) {
+                if (++grouped == group && end_group(&out, &pend, &grouped) < 0) return -1;
+                continue;
+            }
+            if (strncmp(line, "BATCH", 5) == 0) { in_batch = 1; continue; }
+            if (in_batch && strncmp(line, "EXEC", 4) != 0) { in_batch++; continue; }
+            expect_reply(&pend, is_multiline(line), in_batch ? in_batch : 1);
+            in_batch = 0;
+        }
+        // A partial group goes out now, or its ops would never be answered
+        if (end_group(&out, &pend, &grouped) < 0) return -1;
+        if (out.len > 0) {
+            if (write_all(sock_fd, out.buf, out.len) < 0) return -1;
+            out.len = 0;
+        }
+        if (pend.count == 0) break;
+
+        // Drain half the window (all of it at EOF) before sending more
+        int keep = eof ? 0 : window / 2;
+        while (pend.count > 0 && pend.load > keep) {
+            const InFlight *r = &pend.ring[pend.head];
+            if (print_reply(conn, r->multiline, "") < 0) {
+                fprintf(stderr, "server closed with %d replies outstanding\n", pend.count);
+                return -1;
+            }
+            pend.load -= r->ops;
+            pend.head = (pend.head + 1) % MAX_WINDOW;
+            pend.count--;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "%ld commands in %.3f s (%.0f/s, window %d)%s\n",
+            sent, secs, secs > 0 ? sent / secs : 0.0, window, quit ? ", QUIT sent" : "");
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s <server-ip> [-b file|-] [-w window] [-B ops]\n"
+                    "  -b  batch mode: pipeline commands from file (or - for stdin)\n"
+                    "  -w  max operations in flight in batch mode (default %d, max %d)\n"
+                    "  -B  send runs of DEPOSIT/WITHDRAW as BATCH ... EXEC of up to\n"
+                    "      this many ops, one reply line each (max %d)\n",
+            prog, DEFAULT_WINDOW, MAX_WINDOW, MAX_GROUP);
+    exit(1);
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <server-ip>\n", argv[0]);
-        return 1;
+    const char *batch = NULL;
+    int window = DEFAULT_WINDOW;
+    int group  = 0;
+    int opt_ch;
+    while ((opt_ch = getopt(argc, argv, "b:w:B:")) != -1) {
+        switch (opt_ch) {
+            case 'b': batch  = optarg; break;
+            case 'w': window = atoi(optarg); break;
+            case 'B': group  = atoi(optarg); break;
+            default:  usage(argv[0]);
+        }
     }
+    if (optind != argc - 1 || window < 1 || window > MAX_WINDOW ||
+        group < 0 || group > MAX_GROUP) usage(argv[0]);
+    const char *server_ip = argv[optind];
 
     int sock_fd;
     struct sockaddr_in serv_addr;
@@ -29,8 +267,8 @@ int main(int argc, char *argv[]) {
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_port   = htons(PORT);
-    if (inet_pton(AF_INET, argv[1], &serv_addr.sin_addr) <= 0) {
-        fprintf(stderr, "Invalid IP address: %s\n", argv[1]);
+    if (inet_pton(AF_INET, server_ip, &serv_addr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid IP address: %s\n", server_ip);
         exit(1);
     }
 
@@ -40,25 +278,22 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    // (d) Read lines from stdin, send to server, print server’s reply
-    char line[BUF_SZ];
-    while (1) {
-        printf("bank> ");
-        if (!fgets(line, BUF_SZ, stdin)) break;  // EOF on stdin
-
-        write(sock_fd, line, strlen(line));
-
-        // Read one line of response
-        char resp[BUF_SZ];
-        ssize_t n = read(sock_fd, resp, BUF_SZ - 1);
-        if (n <= 0) break;   // server closed
-        resp[n] = '\0';
-        printf("  -> %s", resp);
-
-        // If command was QUIT, exit
-        if (strncmp(line, "QUIT", 4) == 0) break;
+    // (d) Send commands, print the server’s replies
+    static Connection conn;
+    conn_init(&conn, sock_fd);
+    int rc = 0;
+    if (batch) {
+        FILE *in = strcmp(batch, "-") == 0 ? stdin : fopen(batch, "r");
+        if (!in) {
+            perror(batch);
+            exit(1);
+        }
+        rc = run_batch(sock_fd, &conn, in, window, group) < 0 ? 1 : 0;
+        if (in != stdin) fclose(in);
+    } else {
+        run_interactive(sock_fd, &conn);
     }
 
     close(sock_fd);
-    return 0;
+    return rc;
 }
@@ -0,0 +1,774 @@
+/*
+ * bank_microbench.c
+ * Micro-benchmarks for the ledger data structures.
+ *
+ *   ./bank_microbench index [N ...]    account lookup latency (default 1k 100k 10M)
+ *   ./bank_microbench stress [T]       T threads hammer the *_network API;
+ *                                      exits non-zero unless money is conserved
+ *   ./bank_microbench alloc [N]        open/close churn over N live accounts:
+ *                                      slab allocator vs. malloc (default 1M)
+ *   ./bank_microbench layout [N ...]   BALANCE-style lookups, old single-struct
+ *                                      layout vs. hot/cold split, with cache
+ *                                      misses from perf_event_open(2)
+ *   ./bank_microbench batch [N] [wal]  N settlement DEPOSITs one at a time vs.
+ *                                      through batch_network(); with a log
+ *                                      file, each commit waits for the disk
+ *   ./bank_microbench auth [N]         N BALANCE requests on one account: PIN
+ *                                      hashed every time vs. a session cache
+ *                                      vs. a LOGIN handle
+ *   ./bank_microbench log [N]          N DEPOSITs with their DEBUG trace
+ *                                      disabled vs. queued for the log writer
+ *                                      (run with 2>/dev/null)
+ *   ./bank_microbench parse [N]        N command lines through the old
+ *                                      strcmp/sscanf parser vs. the registry
+ *                                      and in-place tokenizer, on one core
+ *   ./bank_microbench read [T]         T threads read balances and statements
+ *                                      of accounts a writer keeps changing:
+ *                                      under the stripe lock vs. seqlock
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "bankapp.h"
+#include "ledger.h"
+#include "slab.h"
+#include "wal.h"
+#include "log.h"
+#include "command_processor.h"
+
+#define LOOKUPS  2000000
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// xorshift: cheap, deterministic key stream that does not pollute the cache
+static uint32_t rng_state = 2463534242u;
+static uint32_t next_rand(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// The old layout: a singly linked list walked from the head
+typedef struct ListNode {
+    int              key;
+    struct ListNode *next;
+} ListNode;
+
+//
+// Lookup latency for N accounts: hash index vs. the old linked-list scan.
+// The list is only measured while it finishes in reasonable time.
+//
+static void bench_index(size_t n) {
+    // The index only stores pointers, so one dummy record serves every key
+    static Account dummy;
+    AccountIndex ix;
+    if (index_init(&ix, 16) < 0) {
+        fprintf(stderr, "index_init failed\n");
+        exit(1);
+    }
+    double t0 = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        if (index_insert(&ix, (int)(1001 + i), &dummy) < 0) {
+            fprintf(stderr, "index_insert failed at %zu\n", i);
+            exit(1);
+        }
+    }
+    double build_ns = now_ns() - t0;
+
+    volatile uintptr_t sink = 0;
+    t0 = now_ns();
+    for (int i = 0; i < LOOKUPS; i++) {
+        int key = (int)(1001 + next_rand() % n);
+        sink += (uintptr_t)index_lookup(&ix, key);
+    }
+    double idx_ns = (now_ns() - t0) / LOOKUPS;
+
+    printf("%10zu accounts: index %7.1f ns/lookup (build %.0f ms, %zu slots)",
+           n, idx_ns, build_ns / 1e6, ix.capacity);
+    index_destroy(&ix);
+
+    if (n <= 100000) {
+        ListNode *head = NULL;
+        for (size_t i = 0; i < n; i++) {
+            ListNode *node = malloc(sizeof(ListNode));
+            node->key  = (int)(1001 + i);
+            node->next = head;
+            head = node;
+        }
+        int list_lookups = n <= 1000 ? 200000 : 2000;
+        t0 = now_ns();
+        for (int i = 0; i < list_lookups; i++) {
+            int key = (int)(1001 + next_rand() % n);
+            ListNode *cur = head;
+            while (cur && cur->key != key) cur = cur->next;
+            sink += (uintptr_t)cur;
+        }
+        printf("  list %10.1f ns/lookup", (now_ns() - t0) / list_lookups);
+        while (head) {
+            ListNode *next = head->next;
+            free(head);
+            head = next;
+        }
+    }
+    printf("\n");
+}
+
+//
+// Concurrency stress: worker threads TRANSFER money between random pairs of
+// a fixed set of accounts (two stripes each, in either order) and read
+// balances, while a churn thread keeps OPENing and CLOSEing unrelated
+// accounts so the index changes underneath them. With correct locking the
+// total across the fixed set never changes.
+//
+#define STRESS_ACCOUNTS  1000
+#define STRESS_ITERS     200000
+#define STRESS_FUNDING   100000
+
+static int stress_acct[STRESS_ACCOUNTS];
+static int stress_pin[STRESS_ACCOUNTS];
+static atomic_int stress_done;
+static atomic_long stress_errors;
+
+static void *stress_worker(void *arg) {
+    unsigned seed = (unsigned)(uintptr_t)arg;
+    for (int i = 0; i < STRESS_ITERS; i++) {
+        int a = rand_r(&seed) % STRESS_ACCOUNTS;
+        int b = rand_r(&seed) % STRESS_ACCOUNTS;
+        int amt = MIN_WITHDRAW * (1 + rand_r(&seed) % 4);
+        if (a == b) {
+            if (balance_network(stress_acct[a], stress_pin[a]) < MIN_BALANCE)
+                atomic_fetch_add(&stress_errors, 1);
+            continue;
+        }
+        int bal = transfer_network(stress_acct[a], stress_pin[a], stress_acct[b], amt);
+        if (bal >= 0 && bal < MIN_BALANCE)
+            atomic_fetch_add(&stress_errors, 1);   // overdrawn
+    }
+    return NULL;
+}
+
+static void *stress_churn(void *arg) {
+    (void)arg;
+    while (!atomic_load(&stress_done)) {
+        int an, pin;
+        open_account_network("churn", "0", "savings", &an, &pin);
+        if (an < 0) continue;
+        deposit_network(an, pin, MIN_WITHDRAW);
+        if (close_account_network(an, pin) != 0)
+            atomic_fetch_add(&stress_errors, 1);
+    }
+    return NULL;
+}
+
+static int bench_stress(int threads) {
+    long expected = 0;
+    for (int i = 0; i < STRESS_ACCOUNTS; i++) {
+        open_account_network("stress", "0", "savings", &stress_acct[i], &stress_pin[i]);
+        if (stress_acct[i] < 0 ||
+            deposit_network(stress_acct[i], stress_pin[i], STRESS_FUNDING) < 0) {
+            printf("setup failed at account %d\n", i);
+            return 1;
+        }
+        expected += MIN_BALANCE + STRESS_FUNDING;
+    }
+
+    pthread_t churn, *workers = calloc(threads, sizeof(pthread_t));
+    double t0 = now_ns();
+    pthread_create(&churn, NULL, stress_churn, NULL);
+    for (int t = 0; t < threads; t++)
+        pthread_create(&workers[t], NULL, stress_worker, (void*)(uintptr_t)(t + 1));
+    for (int t = 0; t < threads; t++)
+        pthread_join(workers[t], NULL);
+    atomic_store(&stress_done, 1);
+    pthread_join(churn, NULL);
+    double secs = (now_ns() - t0) / 1e9;
+    free(workers);
+
+    long total = 0;
+    for (int i = 0; i < STRESS_ACCOUNTS; i++)
+        total += balance_network(stress_acct[i], stress_pin[i]);
+
+    long errors = atomic_load(&stress_errors);
+    printf("%d threads, %d transfers each: %.0f transfers/s\n",
+            threads, STRESS_ITERS, threads * (double)STRESS_ITERS / secs);
+    printf("total balance %ld (expected %ld), %ld errors: %s\n",
+            total, expected, errors,
+            (total == expected && errors == 0) ? "CONSERVED" : "VIOLATED");
+    return (total == expected && errors == 0) ? 0 : 1;
+}
+
+//
+// Allocator churn: keep N Account records live, then repeatedly free a random
+// one and allocate its replacement (CLOSE + OPEN), and finally walk every
+// live record (what a snapshot or a balance sweep does). Run once with the
+// slab and once with malloc/free, same key stream for both.
+//
+#define ALLOC_CHURN  4000000
+
+static Slab bench_slab;
+
+static void *bench_alloc(int use_slab) {
+    return use_slab ? slab_alloc(&bench_slab) : malloc(sizeof(Account));
+}
+
+static void bench_release(int use_slab, void *p) {
+    if (use_slab) slab_free(&bench_slab, p);
+    else free(p);
+}
+
+static void bench_alloc_one(size_t n, int use_slab) {
+    Account **live = malloc(n * sizeof(Account*));
+    if (!live) {
+        perror("malloc");
+        exit(1);
+    }
+    slab_init(&bench_slab, sizeof(Account), LEDGER_SLAB_CHUNK);
+    rng_state = 2463534242u;
+
+    double t0 = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        live[i] = bench_alloc(use_slab);
+        live[i]->balance = MIN_BALANCE;
+    }
+    double fill_ns = (now_ns() - t0) / n;
+
+    t0 = now_ns();
+    for (int i = 0; i < ALLOC_CHURN; i++) {
+        size_t k = next_rand() % n;
+        bench_release(use_slab, live[k]);
+        live[k] = bench_alloc(use_slab);
+        live[k]->balance = MIN_BALANCE;
+    }
+    double churn_ns = (now_ns() - t0) / ALLOC_CHURN;
+
+    volatile long sum = 0;
+    t0 = now_ns();
+    for (size_t i = 0; i < n; i++) sum += live[i]->balance;
+    double scan_ns = (now_ns() - t0) / n;
+
+    printf("%-6s %8zu live: open %6.1f ns  close+open %6.1f ns  sweep %5.1f ns/account\n",
+           use_slab ? "slab" : "malloc", n, fill_ns, churn_ns, scan_ns);
+    if (use_slab) {
+        SlabStats st = bench_slab.stats;
+        printf("       slab stats: live %zu, free %zu, high-water %zu, capacity %zu in %zu chunks\n",
+               st.live, st.free, st.high_water, st.capacity, st.chunks);
+    } else {
+        for (size_t i = 0; i < n; i++) free(live[i]);
+    }
+    free(live);   // slab chunks are left mapped until exit
+}
+
+//
+// Cache behaviour of a balance-heavy workload. The old Account kept PIN and
+// balance inside a ~180-byte record next to the name, ID and history; now
+// the hot fields are a 32-byte record and the rest sits in AccountDetails.
+// Both variants are reached through the same hash index and do the same
+// work per lookup: compare a key field, add up the balance (the split record
+// has no PIN; that check now goes through auth.c, measured by "auth").
+//
+typedef struct LegacyAccount {
+    int account_number;
+    int pin;
+    char name[50];
+    char nid[20];
+    char account_type[10];
+    int balance;
+    struct { char type[10]; int amount; } transactions[MAX_TRANS];
+    int trans_count;
+} LegacyAccount;
+
+#define LAYOUT_LOOKUPS  4000000
+
+// Hardware cache-miss counter for this thread; -1 if the kernel won't allow it
+static int open_miss_counter(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.config         = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long long read_misses(int fd) {
+    long long count = -1;
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) return -1;
+    return count;
+}
+
+static void run_layout(const char *label, AccountIndex *ix, size_t n, int legacy, int perf_fd) {
+    volatile long sum = 0;
+    rng_state = 2463534242u;
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    double t0 = now_ns();
+    for (int i = 0; i < LAYOUT_LOOKUPS; i++) {
+        int key = (int)(1001 + next_rand() % n);
+        void *rec = index_lookup(ix, key);
+        if (legacy) {
+            LegacyAccount *a = rec;
+            if (a->pin == key) sum += a->balance;
+        } else {
+            Account *a = rec;
+            if (a->account_number == key) sum += a->balance;
+        }
+    }
+    double ns = (now_ns() - t0) / LAYOUT_LOOKUPS;
+    if (perf_fd >= 0) ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    long long misses = read_misses(perf_fd);
+
+    printf("  %-9s %6.1f ns/lookup", label, ns);
+    if (misses >= 0) printf("  %6.2f cache misses/lookup", (double)misses / LAYOUT_LOOKUPS);
+    printf("\n");
+}
+
+static void bench_layout(size_t n, int perf_fd) {
+    AccountIndex legacy_ix, split_ix;
+    LegacyAccount *legacy = calloc(n, sizeof(LegacyAccount));
+    Account *hot = calloc(n, sizeof(Account));
+    AccountDetails *cold = calloc(n, sizeof(AccountDetails));
+    if (!legacy || !hot || !cold ||
+        index_init(&legacy_ix, index_slots_for(n)) < 0 ||
+        index_init(&split_ix, index_slots_for(n)) < 0) {
+        fprintf(stderr, "out of memory for %zu accounts\n", n);
+        exit(1);
+    }
+    for (size_t i = 0; i < n; i++) {
+        int key = (int)(1001 + i);
+        legacy[i].account_number = hot[i].account_number = key;
+        legacy[i].pin            = key;
+        legacy[i].balance        = hot[i].balance        = MIN_BALANCE;
+        hot[i].details = &cold[i];
+        index_insert(&legacy_ix, key, (Account*)&legacy[i]);
+        index_insert(&split_ix, key, &hot[i]);
+    }
+
+    printf("%zu accounts (record %zu bytes -> hot %zu + cold %zu):\n",
+           n, sizeof(LegacyAccount), sizeof(Account), sizeof(AccountDetails));
+    run_layout("one-struct", &legacy_ix, n, 1, perf_fd);
+    run_layout("hot/cold", &split_ix, n, 0, perf_fd);
+
+    index_destroy(&legacy_ix);
+    index_destroy(&split_ix);
+    free(legacy);
+    free(hot);
+    free(cold);
+}
+
+//
+// Bulk settlement: N deposits spread over BATCH_ACCOUNTS accounts, applied
+// one call (and, with a log, one commit) per op, then as BATCH_MAX-op
+// batches with one commit each, the way a client's BATCH ... EXEC runs.
+//
+#define BATCH_ACCOUNTS  10000
+
+static int bench_batch(size_t n, const char *wal_path) {
+    if (wal_path) {
+        unlink(wal_path);   // a fresh log: nothing to replay
+        if (wal_open(wal_path, 0) < 0) {
+            perror(wal_path);
+            return 1;
+        }
+    }
+
+    static int acct[BATCH_ACCOUNTS], pin[BATCH_ACCOUNTS];
+    for (int i = 0; i < BATCH_ACCOUNTS; i++)
+        open_account_network("settle", "0", "savings", &acct[i], &pin[i]);
+
+    rng_state = 2463534242u;
+    double t0 = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        int k = next_rand() % BATCH_ACCOUNTS;
+        deposit_network(acct[k], pin[k], MIN_WITHDRAW);
+        wal_wait_durable(wal_take_dependency());
+    }
+    double single_ns = (now_ns() - t0) / n;
+
+    static BatchOp ops[BATCH_MAX];
+    rng_state = 2463534242u;
+    t0 = now_ns();
+    for (size_t done = 0; done < n; ) {
+        int m = n - done < BATCH_MAX ? (int)(n - done) : BATCH_MAX;
+        for (int i = 0; i < m; i++) {
+            int k = next_rand() % BATCH_ACCOUNTS;
+            ops[i] = (BatchOp){ .acct_no = acct[k], .pin = pin[k],
+                                .amount = MIN_WITHDRAW, .kind = TXN_DEPOSIT };
+        }
+        if (batch_network(ops, m) != m) {
+            printf("batch op failed\n");
+            return 1;
+        }
+        wal_wait_durable(wal_take_dependency());
+        done += m;
+    }
+    double batch_ns = (now_ns() - t0) / n;
+
+    printf("%zu deposits%s: one at a time %8.1f ns/op, batches of %d %8.1f ns/op (%.1fx)\n",
+            n, wal_path ? " (logged)" : "", single_ns, BATCH_MAX, batch_ns, single_ns / batch_ns);
+    return 0;
+}
+
+//
+// Cost of the PIN check on the request path: BALANCE on one account with no
+// session bound (every request hashes the PIN), with a connection's
+// AuthCache bound (only the first one does), and after LOGIN (no PIN and
+// no index lookup at all).
+//
+static int bench_auth(size_t n) {
+    int acct, pin;
+    open_account_network("auth", "0", "savings", &acct, &pin);
+    if (acct < 0) {
+        printf("setup failed\n");
+        return 1;
+    }
+
+    double t0 = now_ns();
+    for (size_t i = 0; i < n; i++)
+        if (balance_network(acct, pin) < 0) return 1;
+    double hashed_ns = (now_ns() - t0) / n;
+
+    AuthCache cache = { .used = 0 };
+    auth_bind_session(&cache);
+    t0 = now_ns();
+    for (size_t i = 0; i < n; i++)
+        if (balance_network(acct, pin) < 0) return 1;
+    double cached_ns = (now_ns() - t0) / n;
+
+    cache.login = login_network(acct, pin, &cache.login_generation);
+    cache.login_acct = acct;
+    t0 = now_ns();
+    for (size_t i = 0; i < n; i++)
+        if (balance_network(acct, SESSION_PIN) < 0) return 1;
+    double login_ns = (now_ns() - t0) / n;
+    auth_bind_session(NULL);
+
+    printf("%zu BALANCE requests: PIN hashed %7.1f ns/op, session cache %7.1f ns/op, "
+            "LOGIN %7.1f ns/op\n", n, hashed_ns, cached_ns, login_ns);
+    return 0;
+}
+
+//
+// What the DEBUG trace in deposit_network() costs: not at all while the level
+// is INFO, and one format into the thread's ring once it is DEBUG. The
+// ring fills faster than stderr drains, so some of the traces are dropped.
+//
+static int bench_log(size_t n) {
+    int acct, pin;
+    open_account_network("trace", "0", "savings", &acct, &pin);
+    if (acct < 0) {
+        printf("setup failed\n");
+        return 1;
+    }
+    if (log_start(LOG_LEVEL_INFO) < 0) {
+        printf("no log writer thread\n");
+        return 1;
+    }
+    AuthCache cache = { .used = 0 };   // keep PIN hashing out of the numbers
+    auth_bind_session(&cache);
+
+    double t0 = now_ns();
+    for (size_t i = 0; i < n; i++)
+        if (deposit_network(acct, pin, MIN_WITHDRAW) < 0) return 1;
+    double off_ns = (now_ns() - t0) / n;
+
+    atomic_store(&log_level, LOG_LEVEL_DEBUG);
+    t0 = now_ns();
+    for (size_t i = 0; i < n; i++)
+        if (deposit_network(acct, pin, MIN_WITHDRAW) < 0) return 1;
+    double on_ns = (now_ns() - t0) / n;
+    atomic_store(&log_level, LOG_LEVEL_INFO);
+    auth_bind_session(NULL);
+
+    printf("%zu deposits: DEBUG trace off %7.1f ns/op, on %7.1f ns/op\n", n, off_ns, on_ns);
+    return 0;
+}
+
+//
+// Parsing alone, no ledger work: a mix of request lines, each copied to a
+// scratch buffer first as the connection's input buffer would hold it. The
+// legacy parser is the one process_command() used before the registry:
+// sscanf the word, a strcmp chain, then sscanf the arguments at a fixed
+// offset. The sum of the parsed numbers keeps both honest.
+//
+static const char *parse_corpus[] = {
+    "DEPOSIT 1001 4722 2000",
+    "WITHDRAW 1001 4722 500",
+    "BALANCE 1001 4722",
+    "TRANSFER 1001 4722 1002 250",
+    "DEPOSIT 123456 9999 15",
+    "STATEMENT 1001 4722 0 50",
+    "BALANCE 987654 1234",
+    "LOGIN 1001 4722",
+    "OPEN alice 12345 savings",
+    "CLOSE 1001 4722",
+};
+#define PARSE_CORPUS_LEN  (sizeof(parse_corpus) / sizeof(parse_corpus[0]))
+
+static long legacy_parse(const char *buf) {
+    char cmd[16] = "";
+    int a = 0, b = 0, c = 0, d = 0;
+    sscanf(buf, "%15s", cmd);
+    if (strcmp(cmd, "OPEN") == 0) {
+        char name[64], nid[32], type[16];
+        return sscanf(buf + 5, "%63s %31s %15s", name, nid, type);
+    } else if (strcmp(cmd, "DEPOSIT") == 0) {
+        sscanf(buf + 7, "%d %d %d", &a, &b, &c);
+    } else if (strcmp(cmd, "WITHDRAW") == 0) {
+        sscanf(buf + 8, "%d %d %d", &a, &b, &c);
+    } else if (strcmp(cmd, "TRANSFER") == 0) {
+        sscanf(buf + 8, "%d %d %d %d", &a, &b, &c, &d);
+    } else if (strcmp(cmd, "BALANCE") == 0) {
+        sscanf(buf + 7, "%d %d", &a, &b);
+    } else if (strcmp(cmd, "STATEMENT") == 0) {
+        sscanf(buf + 9, "%d %d %d %d", &a, &b, &c, &d);
+    } else if (strcmp(cmd, "CLOSE") == 0) {
+        sscanf(buf + 5, "%d %d", &a, &b);
+    } else if (strcmp(cmd, "LOGIN") == 0) {
+        sscanf(buf + 5, "%d %d", &a, &b);
+    }
+    return (long)a + b + c + d;
+}
+
+static long registry_parse(char *buf) {
+    Request req;
+    parse_request(buf, &req);
+    if (req.cmd == CMD_OPEN) return req.argc;
+    long sum = 0;
+    for (int i = 0; i < req.argc; i++) sum += request_int(&req, i);
+    return sum;
+}
+
+static int bench_parse(size_t n) {
+    char scratch[64];
+    size_t lens[PARSE_CORPUS_LEN];
+    for (size_t i = 0; i < PARSE_CORPUS_LEN; i++) lens[i] = strlen(parse_corpus[i]) + 1;
+
+    long legacy_sum = 0;
+    double t0 = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        size_t k = i % PARSE_CORPUS_LEN;
+        memcpy(scratch, parse_corpus[k], lens[k]);
+        legacy_sum += legacy_parse(scratch);
+    }
+    double legacy_ns = (now_ns() - t0) / n;
+
+    long registry_sum = 0;
+    t0 = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        size_t k = i % PARSE_CORPUS_LEN;
+        memcpy(scratch, parse_corpus[k], lens[k]);
+        registry_sum += registry_parse(scratch);
+    }
+    double registry_ns = (now_ns() - t0) / n;
+
+    if (legacy_sum != registry_sum) {
+        printf("parsers disagree: %ld vs %ld\n", legacy_sum, registry_sum);
+        return 1;
+    }
+    printf("%zu commands: strcmp/sscanf %6.1f ns/cmd (%5.2f M cmd/s), "
+           "registry %6.1f ns/cmd (%5.2f M cmd/s)\n", n,
+           legacy_ns, 1e3 / legacy_ns, registry_ns, 1e3 / registry_ns);
+    return 0;
+}
+
+//
+// Reads against writes on the same accounts: T reader threads alternate
+// BALANCE and STATEMENT on a few hot accounts while one writer keeps
+// depositing READ_AMOUNT to each and withdrawing it again, first through the
+// old path that holds the stripe lock, then through the seqlock one. A torn
+// read shows: a balance other than MIN_BALANCE or MIN_BALANCE + READ_AMOUNT,
+// or a statement whose entries do not alternate deposit / withdrawal.
+//
+#define READ_ACCOUNTS  4
+#define READ_SECS      2
+#define READ_AMOUNT    700
+
+static int read_acct[READ_ACCOUNTS];
+static int read_pin[READ_ACCOUNTS];
+static int read_locked;              // phase: 1 = stripe lock, 0 = seqlock
+static atomic_int  read_done;
+static atomic_long read_ops, read_torn, write_ops;
+
+static int locked_balance(int acct_no, int pin) {
+    ledger_lock_account(acct_no);
+    Account *acc = find_account(acct_no, pin);
+    int bal = acc ? acc->balance : -1;
+    ledger_unlock_account(acct_no);
+    return bal;
+}
+
+static int locked_statement(int acct_no, int pin, Transaction out[MAX_TRANS]) {
+    ledger_lock_account(acct_no);
+    Account *acc = find_account(acct_no, pin);
+    int n = acc ? mini_statement(acc, out) : -1;
+    ledger_unlock_account(acct_no);
+    return n;
+}
+
+static void *read_worker(void *arg) {
+    AuthCache cache = { .used = 0 };   // PIN hashing would hide the difference
+    auth_bind_session(&cache);
+    long ops = 0, torn = 0;
+    for (unsigned i = (unsigned)(uintptr_t)arg; !atomic_load(&read_done); i++) {
+        int k = i % READ_ACCOUNTS;
+        if (i & 1) {
+            int bal = read_locked ? locked_balance(read_acct[k], read_pin[k])
+                                  : balance_network(read_acct[k], read_pin[k]);
+            if (bal != MIN_BALANCE && bal != MIN_BALANCE + READ_AMOUNT) torn++;
+        } else {
+            Transaction t[MAX_TRANS];
+            int n = read_locked ? locked_statement(read_acct[k], read_pin[k], t)
+                                : statement_entries_network(read_acct[k], read_pin[k], t);
+            if (n < 0) torn++;
+            for (int j = 0; j < n; j++)
+                if (t[j].amount != READ_AMOUNT || (j && t[j].kind == t[j - 1].kind)) torn++;
+        }
+        ops++;
+    }
+    auth_bind_session(NULL);
+    atomic_fetch_add(&read_ops, ops);
+    atomic_fetch_add(&read_torn, torn);
+    return NULL;
+}
+
+static void *read_writer(void *arg) {
+    (void)arg;
+    AuthCache cache = { .used = 0 };
+    auth_bind_session(&cache);
+    for (unsigned i = 0; !atomic_load(&read_done); i++) {
+        int k = i % READ_ACCOUNTS;
+        int ok = i / READ_ACCOUNTS % 2
+               ? withdraw_network(read_acct[k], read_pin[k], READ_AMOUNT) >= 0
+               : deposit_network(read_acct[k], read_pin[k], READ_AMOUNT) >= 0;
+        if (ok) atomic_fetch_add_explicit(&write_ops, 1, memory_order_relaxed);
+    }
+    auth_bind_session(NULL);
+    return NULL;
+}
+
+// Fresh accounts each run: the writer may have stopped between a deposit
+// and its withdrawal
+static int run_reads(int threads, int locked) {
+    for (int i = 0; i < READ_ACCOUNTS; i++) {
+        open_account_network("read", "0", "savings", &read_acct[i], &read_pin[i]);
+        if (read_acct[i] < 0) {
+            printf("setup failed\n");
+            return 1;
+        }
+    }
+    read_locked = locked;
+    atomic_store(&read_done, 0);
+    atomic_store(&read_ops, 0);
+    atomic_store(&read_torn, 0);
+    atomic_store(&write_ops, 0);
+
+    pthread_t writer, *readers = calloc(threads, sizeof(pthread_t));
+    pthread_create(&writer, NULL, read_writer, NULL);
+    for (int t = 0; t < threads; t++)
+        pthread_create(&readers[t], NULL, read_worker, (void*)(uintptr_t)t);
+    sleep(READ_SECS);
+    atomic_store(&read_done, 1);
+    for (int t = 0; t < threads; t++) pthread_join(readers[t], NULL);
+    pthread_join(writer, NULL);
+    free(readers);
+
+    printf("  %-11s %10.0f reads/s (%9.0f per thread), %9.0f writes/s, %ld torn\n",
+           locked ? "stripe lock" : "seqlock",
+           (double)atomic_load(&read_ops) / READ_SECS,
+           (double)atomic_load(&read_ops) / READ_SECS / threads,
+           (double)atomic_load(&write_ops) / READ_SECS, atomic_load(&read_torn));
+    return atomic_load(&read_torn) ? 1 : 0;
+}
+
+static int bench_read(int threads) {
+    printf("%d readers, 1 writer, %d accounts:\n", threads, READ_ACCOUNTS);
+    int rc = run_reads(threads, 1);
+    return run_reads(threads, 0) | rc;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s index [N ...]\n"
+                    "       %s stress [threads]\n"
+                    "       %s alloc [N]\n"
+                    "       %s layout [N ...]\n"
+                    "       %s batch [N] [wal-file]\n"
+                    "       %s auth [N]\n"
+                    "       %s log [N]\n"
+                    "       %s parse [N]\n"
+                    "       %s read [threads]\n", prog, prog, prog, prog, prog, prog, prog, prog, prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) usage(argv[0]);
+
+    if (strcmp(argv[1], "index") == 0) {
+        if (argc == 2) {
+            bench_index(1000);
+            bench_index(100000);
+            bench_index(10000000);
+        } else {
+            for (int i = 2; i < argc; i++) bench_index(strtoul(argv[i], NULL, 10));
+        }
+    } else if (strcmp(argv[1], "stress") == 0) {
+        int threads = argc > 2 ? atoi(argv[2]) : 8;
+        if (threads < 1) usage(argv[0]);
+        return bench_stress(threads);
+    } else if (strcmp(argv[1], "alloc") == 0) {
+        size_t n = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+        if (n == 0) usage(argv[0]);
+        bench_alloc_one(n, 0);
+        bench_alloc_one(n, 1);
+    } else if (strcmp(argv[1], "layout") == 0) {
+        int perf_fd = open_miss_counter();
+        if (perf_fd < 0) perror("perf_event_open (cache misses not reported)");
+        if (argc == 2) {
+            bench_layout(100000, perf_fd);
+            bench_layout(1000000, perf_fd);
+            bench_layout(10000000, perf_fd);
+        } else {
+            for (int i = 2; i < argc; i++) bench_layout(strtoul(argv[i], NULL, 10), perf_fd);
+        }
+        if (perf_fd >= 0) close(perf_fd);
+    } else if (strcmp(argv[1], "batch") == 0) {
+        size_t n = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+        if (n == 0) usage(argv[0]);
+        return bench_batch(n, argc > 3 ? argv[3] : NULL);
+    } else if (strcmp(argv[1], "auth") == 0) {
+        size_t n = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+        if (n == 0) usage(argv[0]);
+        return bench_auth(n);
+    } else if (strcmp(argv[1], "log") == 0) {
+        size_t n = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+        if (n == 0) usage(argv[0]);
+        return bench_log(n);
+    } else if (strcmp(argv[1], "parse") == 0) {
+        size_t n = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000000;
+        if (n == 0) usage(argv[0]);
+        return bench_parse(n);
+    } else if (strcmp(argv[1], "read") == 0) {
+        int threads = argc > 2 ? atoi(argv[2]) : 4;
+        if (threads < 1) usage(argv[0]);
+        return bench_read(threads);
+    } else {
+        usage(argv[0]);
+    }
+    return 0;
+}
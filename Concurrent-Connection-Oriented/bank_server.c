@@ -5,146 +5,138 @@
 #include <sys/types.h>
 #include <sys/socket.h>     // socket(), bind(), listen(), accept()
 #include <netinet/in.h>     // sockaddr_in, htons(), INADDR_ANY
+#include <netinet/tcp.h>    // TCP_INFO
 #include <arpa/inet.h>      // inet_ntoa()
-#include <signal.h>         // signal(), SIG_IGN
+#include <signal.h>         // sigaction(), SIGCHLD
+#include <errno.h>
+#include <sys/wait.h>       // waitpid()
 
 #define PORT     3333
 #define BACKLOG  10
-#define BUF_SZ   256
+#define DEFAULT_SHARED_ACCOUNTS  (1 << 20)
+#define METRIC_SHARDS  64   // children whose requests are counted at any one time
 
 #include "bankapp.h"
+#include "ledger.h"
+#include "snapshot.h"
+#include "connection.h"
+#include "command_processor.h"
+#include "log.h"
+#include "metrics.h"
+
+static int listen_fd = -1;
 
 //
-// Send a null‑terminated string plus “\n” over sock_fd
+// Handle one connected client: serve_connection() frames each command line,
+// hands it to process_command() (the same dispatcher the other servers use, so
+// replies are framed identically) and flushes every batch of replies with one
+// write(), until the client sends “QUIT” or disconnects.
 //
-void send_line(int sock_fd, const char *msg) {
-    write(sock_fd, msg, strlen(msg));
-    write(sock_fd, "\n", 1);
+void handle_client(int client_fd) {
+    static Connection conn;   // one connection per child process
+    conn_init(&conn, client_fd);
+    serve_connection(&conn);
+    metrics_release();   // the next child counts on in this shard
+    conn_destroy(&conn);
+    close(client_fd);
+    exit(0);  // child must exit
 }
 
 //
-// Read one line (up to BUF_SZ‑1 chars) from sock_fd into buf.
-// Stops at '\n'. Returns number of bytes read (excluding '\n'), or 0 on EOF.
+// Reap every child that has exited. The parent, not the child, counts the
+// connection closed and frees the child's metrics shard, so a child that was
+// killed or crashed does not keep either.
 //
-ssize_t recv_line(int sock_fd, char *buf) {
-    ssize_t total = 0;
-    while (total < BUF_SZ - 1) {
-        char c;
-        ssize_t n = read(sock_fd, &c, 1);
-        if (n <= 0) return 0;  // client closed or error
-        if (c == '\n') break;
-        buf[total++] = c;
+static void on_child_exit(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        metrics_reap(pid);
+        metrics_connection_closed();
     }
-    buf[total] = '\0';
-    return total;
+    errno = saved_errno;
 }
 
-//
-// Handle one connected client. Loop: recv command line, parse, call network wrappers,
-// send back “OK …” or “ERR …”, until client sends “QUIT”.
-//
-void handle_client(int client_fd) {
-    char buf[BUF_SZ];
-    while (1) {
-        ssize_t len = recv_line(client_fd, buf);
-        if (len == 0) break;  // client closed
-
-        char cmd[16];
-        sscanf(buf, "%15s", cmd);
-
-        // OPEN name nid acct_type
-        if (strcmp(cmd, "OPEN") == 0) {
-            char name[50], nid[20], type[10];
-            sscanf(buf + 5, "%49s %19s %9s", name, nid, type);
-            int acct_no, pin;
-            open_account_network(name, nid, type, &acct_no, &pin);
-            if (acct_no < 0) {
-                send_line(client_fd, "ERR cannot open account");
-            } else {
-                char resp[64];
-                snprintf(resp, sizeof(resp), "OK %d %d", acct_no, pin);
-                send_line(client_fd, resp);
-            }
-        }
-        // DEPOSIT acct_no PIN amount
-        else if (strcmp(cmd, "DEPOSIT") == 0) {
-            int an, p, amt;
-            sscanf(buf + 8, "%d %d %d", &an, &p, &amt);
-            int new_bal = deposit_network(an, p, amt);
-            if (new_bal >= 0) {
-                char resp[64];
-                snprintf(resp, sizeof(resp), "OK %d", new_bal);
-                send_line(client_fd, resp);
-            } else {
-                send_line(client_fd, "ERR deposit failed");
-            }
-        }
-        // WITHDRAW acct_no PIN amount
-        else if (strcmp(cmd, "WITHDRAW") == 0) {
-            int an, p, amt;
-            sscanf(buf + 9, "%d %d %d", &an, &p, &amt);
-            int new_bal = withdraw_network(an, p, amt);
-            if (new_bal >= 0) {
-                char resp[64];
-                snprintf(resp, sizeof(resp), "OK %d", new_bal);
-                send_line(client_fd, resp);
-            } else {
-                send_line(client_fd, "ERR withdrawal failed");
-            }
-        }
-        // BALANCE acct_no PIN
-        else if (strcmp(cmd, "BALANCE") == 0) {
-            int an, p;
-            sscanf(buf + 8, "%d %d", &an, &p);
-            int bal = balance_network(an, p);
-            if (bal >= 0) {
-                char resp[64];
-                snprintf(resp, sizeof(resp), "OK %d", bal);
-                send_line(client_fd, resp);
-            } else {
-                send_line(client_fd, "ERR balance check failed");
-            }
-        }
-        // STATEMENT acct_no PIN
-        else if (strcmp(cmd, "STATEMENT") == 0) {
-            int an, p;
-            sscanf(buf + 10, "%d %d", &an, &p);
-            char *stm = statement_network(an, p);
-            if (!stm) {
-                send_line(client_fd, "ERR cannot get statement");
-            } else {
-                send_line(client_fd, "OK");
-                write(client_fd, stm, strlen(stm));
-                free(stm);
-            }
-        }
-        // CLOSE acct_no PIN
-        else if (strcmp(cmd, "CLOSE") == 0) {
-            int an, p;
-            sscanf(buf + 6, "%d %d", &an, &p);
-            int r = close_account_network(an, p);
-            if (r == 0) {
-                send_line(client_fd, "OK");
-            } else {
-                send_line(client_fd, "ERR close failed");
-            }
+// Connections the kernel has completed that accept() has not taken yet: for
+// a listening socket Linux reports its accept queue length as tcpi_unacked
+static long listen_backlog(void) {
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    if (listen_fd < 0 || getsockopt(listen_fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) return 0;
+    return ti.tcpi_unacked;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-s] [-n max_accounts] [-w wal_file [-c secs]] [-m port] [-v]\n"
+                    "  -s  keep the ledger in shared memory so all children see one table\n"
+                    "  -n  account capacity of the shared ledger (default %d)\n"
+                    "  -w  write-ahead log: replay it at startup, log every change (needs -s)\n"
+                    "  -c  seconds between background snapshots of the table (0 = never; default %d)\n"
+                    "  -m  port of the Prometheus metrics endpoint (0 = none; default %d)\n"
+                    "  -v  log DEBUG traces (SIGUSR1 / SIGUSR2 raise / lower the level later)\n",
+            prog, DEFAULT_SHARED_ACCOUNTS, SNAPSHOT_DEFAULT_INTERVAL, METRICS_DEFAULT_PORT);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in server_addr;
+    int shared = 0;
+    size_t max_accounts = DEFAULT_SHARED_ACCOUNTS;
+    const char *wal_path = NULL;
+    int snapshot_secs = SNAPSHOT_DEFAULT_INTERVAL;
+    int log_lvl = LOG_LEVEL_INFO;
+    int metrics_port = METRICS_DEFAULT_PORT;
+
+    int opt_ch;
+    while ((opt_ch = getopt(argc, argv, "sn:w:c:m:v")) != -1) {
+        switch (opt_ch) {
+            case 's': shared = 1; break;
+            case 'n': max_accounts = strtoul(optarg, NULL, 10); break;
+            case 'w': wal_path = optarg; break;
+            case 'c': snapshot_secs = atoi(optarg); break;
+            case 'm': metrics_port = atoi(optarg); break;
+            case 'v': log_lvl = LOG_LEVEL_DEBUG; break;
+            default:  usage(argv[0]);
         }
-        // QUIT
-        else if (strcmp(cmd, "QUIT") == 0) {
-            break;
+    }
+    // Private per-child ledgers cannot share one log
+    if (max_accounts == 0 || (wal_path && !shared)) usage(argv[0]);
+
+    // Children queue their log lines and write them out between requests (log.c)
+    log_start(log_lvl);
+
+    // Must happen before the first fork() so every child inherits the mapping
+    if (shared) {
+        if (ledger_init_shared(max_accounts) < 0) {
+            perror("ledger_init_shared");
+            exit(1);
         }
-        // Unknown command
-        else {
-            send_line(client_fd, "ERR unknown command");
+        printf("Shared ledger: up to %zu accounts\n", max_accounts);
+    }
+
+    // Replay into the shared table; the log's control block is shared too, so
+    // children committing at the same time share one fdatasync
+    if (wal_path) {
+        int n = ledger_recover(wal_path, snapshot_secs);
+        if (n < 0) {
+            perror(wal_path);
+            exit(1);
         }
+        printf("Replayed %d log records from %s\n", n, wal_path);
     }
-    close(client_fd);
-    exit(0);  // child must exit
-}
 
-int main() {
-    int listen_fd;
-    struct sockaddr_in server_addr;
+    // Shards in a shared mapping, so the parent sees what the children count
+    if (metrics_init(METRIC_SHARDS) < 0) {
+        perror("metrics_init");
+        exit(1);
+    }
+    if (shared) metrics_add_gauge("accounts", "Open accounts.", ledger_account_count);
+    metrics_add_gauge("queue_depth", "Connections waiting in the listen backlog.", listen_backlog);
+    if (metrics_port && metrics_serve(metrics_port) < 0) {
+        perror("metrics_serve");
+        exit(1);
+    }
 
     // (a) Create TCP socket
     if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -177,8 +169,13 @@ int main() {
     }
     printf("Server listening on port %d …\n", PORT);
 
-    // (e) Ignore SIGCHLD so that child processes are reaped automatically
-    signal(SIGCHLD, SIG_IGN);
+    // (e) Reap children as they exit
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_child_exit;
+    sa.sa_flags   = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
 
     // (f) Main accept() loop
     while (1) {
@@ -188,13 +185,16 @@ int main() {
 
         client_fd = accept(listen_fd, (struct sockaddr*)&client_addr, &addrlen);
         if (client_fd < 0) {
-            perror("accept");
+            LOG_WARN("accept: %m");
             continue;
         }
 
+        // Counted before the fork so the child's reaping cannot come first
+        metrics_connection_opened();
         pid_t pid = fork();
         if (pid < 0) {
-            perror("fork");
+            LOG_ERROR("fork: %m");
+            metrics_connection_closed();
             close(client_fd);
         }
         else if (pid == 0) {
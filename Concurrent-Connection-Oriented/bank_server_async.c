@@ -1,84 +1,331 @@
 /*
  * bank_server_async.c
- * Concurrent, connection-oriented server using select() for asynchronous I/O
+ * Concurrent, connection-oriented server using edge-triggered epoll
+ * for asynchronous I/O
+ *
+ * With -r N it runs N independent reactors (one thread, one epoll set and one
+ * SO_REUSEPORT listening socket each). The kernel spreads incoming
+ * connections across the listeners, and a connection stays on its reactor
+ * for life. All reactors share one ledger, guarded by its stripe locks.
+ *
+ * With -w the replies of one epoll round are held back, the write-ahead log is
+ * made durable once for all of them, and only then are they flushed.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
 #include "command_processor.h"
+#include "connection.h"
+#include "ledger.h"
+#include "snapshot.h"
+#include "wal.h"
+#include "log.h"
+#include "metrics.h"
 
-#define PORT     3333
-#define BACKLOG  10
-#define BUF_SZ   256
-#define MAX_CLIENTS  FD_SETSIZE
-
-int main() {
-    int listen_fd, max_fd, new_fd;
-    int client_fds[MAX_CLIENTS];
-    struct sockaddr_in serv_addr, cli_addr;
-    socklen_t addrlen;
-    fd_set master_set, read_fds;
-    char buf[BUF_SZ];
-    ssize_t n;
-
-    // Initialize listener
-    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+#define PORT        3333
+#define BACKLOG     1024
+#define MAX_EVENTS  256
+
+// Readiness events the reactors are working through (the queue_depth gauge)
+static atomic_long ready_events;
+
+// Per-connection state is a Connection (fd + input framer), reached directly
+// through epoll_event.data.ptr, so a ready event costs the same no matter how
+// many connections are idle.
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void close_client(int epfd, Connection *c) {
+    metrics_connection_closed();
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    conn_destroy(c);
+    free(c);
+}
+
+//
+// Out of descriptors, accept() fails but leaves the connection in the
+// backlog, and with an edge-triggered listener nothing would wake us for it
+// again. Give up the spare descriptor kept for this, take the connection
+// and close it straight away, then put the spare back. Returns 0 if one
+// connection was shed, -1 if the spare is gone too.
+//
+static int shed_client(int listen_fd, int *spare_fd) {
+    if (*spare_fd < 0) return -1;
+    close(*spare_fd);
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd >= 0) close(fd);
+    *spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return fd >= 0 ? 0 : -1;
+}
+
+//
+// Edge-triggered: we are only told once that the listener is readable, so
+// accept until the backlog is drained.
+//
+static void accept_clients(int epfd, int listen_fd, int *spare_fd) {
+    while (1) {
+        struct sockaddr_in cli_addr;
+        socklen_t addrlen = sizeof(cli_addr);
+        int fd = accept(listen_fd, (struct sockaddr*)&cli_addr, &addrlen);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                LOG_WARN("accept: %m; closing the new connection");
+                if (shed_client(listen_fd, spare_fd) == 0) continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_WARN("accept: %m");
+            }
+            return;
+        }
+        Connection *c = malloc(sizeof(Connection));
+        if (!c || set_nonblocking(fd) < 0) {
+            free(c);
+            close(fd);
+            continue;
+        }
+        conn_init(c, fd);
+
+        // EPOLLOUT is registered once up front: with EPOLLET it only fires when
+        // a full send buffer drains, so no EPOLL_CTL_MOD is needed per reply
+        struct epoll_event ev;
+        ev.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            LOG_WARN("epoll_ctl: %m");
+            close(fd);
+            free(c);
+            continue;
+        }
+        metrics_connection_opened();
+    }
+}
+
+//
+// Called for every readiness event (readable or writable). Edge-triggered:
+// drain the socket until EAGAIN, or the remaining bytes would sit there
+// until the client happens to send more. The only exception is
+// backpressure: while more than CONN_OUT_HIGH bytes of replies are unsent we
+// stop taking commands and return 1; finish_client() picks up from there.
+// Replies are flushed by finish_client() once the whole round has been
+// committed.
+//
+static int serve_client(Connection *c) {
+    while (!c->closing) {
+        if (conn_pending(c) > CONN_OUT_HIGH) return 1;
+        int r = dispatch_input(c);
+        if (r == DISPATCH_DONE) continue;
+        if (r == DISPATCH_CLOSE) {
+            c->closing = 1;   // QUIT: close once the replies are out
+            break;
+        }
+        ssize_t n = conn_fill(c);
+        if (n > 0) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        c->closing = 1;   // EOF or hard error: answer what was read, then close
+        break;
+    }
+    return 0;
+}
+
+//
+// Everything this batch produced goes out in one write(). If serve_client()
+// stopped at the high-water mark and the write took it all, no EPOLLOUT
+// edge will come (the socket never filled), so carry on serving here; only
+// a partial write leaves the rest to EPOLLOUT.
+//
+static void finish_client(int epfd, Connection *c, int backlogged) {
+    while (1) {
+        int rc = conn_flush(c);
+        if (rc < 0 || (c->closing && rc == 0)) {
+            close_client(epfd, c);
+            return;
+        }
+        if (rc == 1 || !backlogged) return;
+        backlogged = serve_client(c);
+        wal_wait_durable(c->commit_lsn);
+    }
+}
+
+//
+// One listening socket per reactor. SO_REUSEPORT lets several sockets bind
+// the same port; the kernel hashes each new connection to one of them.
+//
+static int create_listener(void) {
+    struct sockaddr_in serv_addr;
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (listen_fd < 0) { perror("socket"); exit(1); }
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt(SO_REUSEPORT)"); exit(1);
+    }
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = INADDR_ANY;
     serv_addr.sin_port = htons(PORT);
-    bind(listen_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
-    listen(listen_fd, BACKLOG);
+    if (bind(listen_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        perror("bind"); exit(1);
+    }
+    if (listen(listen_fd, BACKLOG) < 0) {
+        perror("listen"); exit(1);
+    }
+    if (set_nonblocking(listen_fd) < 0) {
+        perror("fcntl"); exit(1);
+    }
+    return listen_fd;
+}
 
-    FD_ZERO(&master_set);
-    FD_SET(listen_fd, &master_set);
-    max_fd = listen_fd;
-    for (int i = 0; i < MAX_CLIENTS; i++) client_fds[i] = -1;
+//
+// Event loop of one reactor. Runs forever; the listener is created by the
+// caller so that every port binding is in place before any thread starts.
+//
+static void *reactor_main(void *arg) {
+    int listen_fd = (int)(intptr_t)arg;
+    int epfd = epoll_create1(0);
+    if (epfd < 0) { perror("epoll_create1"); exit(1); }
+    int spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (spare_fd < 0) { perror("/dev/null"); exit(1); }
 
-    printf("Async Bank Server listening on port %d...\n", PORT);
+    // The listener is tagged with a NULL ptr; every client has its own Connection
+    struct epoll_event ev;
+    ev.events   = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        perror("epoll_ctl"); exit(1);
+    }
 
+    struct epoll_event events[MAX_EVENTS];
+    Connection *served[MAX_EVENTS];
+    int backlogged[MAX_EVENTS];
     while (1) {
-        read_fds = master_set;
-        if (select(max_fd+1, &read_fds, NULL, NULL, NULL) < 0) {
-            perror("select"); exit(1);
-        }
-        // check for new connections
-        if (FD_ISSET(listen_fd, &read_fds)) {
-            addrlen = sizeof(cli_addr);
-            new_fd = accept(listen_fd, (struct sockaddr*)&cli_addr, &addrlen);
-            if (new_fd >= 0) {
-                FD_SET(new_fd, &master_set);
-                if (new_fd > max_fd) max_fd = new_fd;
-                for (int i = 0; i < MAX_CLIENTS; i++) {
-                    if (client_fds[i] < 0) { client_fds[i] = new_fd; break; }
-                }
-            }
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait"); exit(1);
         }
-        // handle data from clients
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            int fd = client_fds[i];
-            if (fd < 0) continue;
-            if (FD_ISSET(fd, &read_fds)) {
-                n = read(fd, buf, BUF_SZ-1);
-                if (n <= 0) {
-                    close(fd);
-                    FD_CLR(fd, &master_set);
-                    client_fds[i] = -1;
-                } else {
-                    buf[n] = '\0';
-                    process_command(fd, buf);
-                }
+        atomic_fetch_add_explicit(&ready_events, n, memory_order_relaxed);
+        int nserved = 0;
+        uint64_t commit_lsn = 0;
+        for (int i = 0; i < n; i++) {
+            Connection *c = events[i].data.ptr;
+            if (!c) {
+                accept_clients(epfd, listen_fd, &spare_fd);
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                close_client(epfd, c);
+            } else {
+                // EPOLLRDHUP still lets us consume what was sent before the FIN
+                backlogged[nserved] = serve_client(c);
+                served[nserved++] = c;
+                if (c->commit_lsn > commit_lsn) commit_lsn = c->commit_lsn;
             }
         }
+        // Group commit: one durability wait covers every reply of this round
+        wal_wait_durable(commit_lsn);
+        for (int i = 0; i < nserved; i++) finish_client(epfd, served[i], backlogged[i]);
+        atomic_fetch_sub_explicit(&ready_events, n, memory_order_relaxed);
     }
+    close(spare_fd);
+    close(epfd);
     close(listen_fd);
+    return NULL;
+}
+
+static long queue_depth_gauge(void) {
+    return atomic_load_explicit(&ready_events, memory_order_relaxed);
+}
+
+//
+// Every idle client holds a descriptor, and the usual soft limit is 1024:
+// go up to the hard limit.
+//
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == rl.rlim_max) return;
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0) LOG_WARN("setrlimit(RLIMIT_NOFILE): %m");
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-r reactors] [-w wal_file [-c secs]] [-m port] [-v]\n"
+                    "  -r  number of event-loop threads (0 = one per online CPU; default 1)\n"
+                    "  -w  write-ahead log: replay it at startup, log every change to it\n"
+                    "  -c  seconds between background snapshots of the table (0 = never; default %d)\n"
+                    "  -m  port of the Prometheus metrics endpoint (0 = none; default %d)\n"
+                    "  -v  log DEBUG traces (SIGUSR1 / SIGUSR2 raise / lower the level later)\n",
+            prog, SNAPSHOT_DEFAULT_INTERVAL, METRICS_DEFAULT_PORT);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    long reactors = 1;
+    const char *wal_path = NULL;
+    int snapshot_secs = SNAPSHOT_DEFAULT_INTERVAL;
+    int log_lvl = LOG_LEVEL_INFO;
+    int metrics_port = METRICS_DEFAULT_PORT;
+    int opt_ch;
+    while ((opt_ch = getopt(argc, argv, "r:w:c:m:v")) != -1) {
+        switch (opt_ch) {
+            case 'r': reactors = strtol(optarg, NULL, 10); break;
+            case 'w': wal_path = optarg; break;
+            case 'c': snapshot_secs = atoi(optarg); break;
+            case 'm': metrics_port = atoi(optarg); break;
+            case 'v': log_lvl = LOG_LEVEL_DEBUG; break;
+            default:  usage(argv[0]);
+        }
+    }
+    if (reactors == 0) reactors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (reactors < 1) usage(argv[0]);
+    log_start(log_lvl);
+    raise_fd_limit();
+
+    if (wal_path) {
+        int n = ledger_recover(wal_path, snapshot_secs);
+        if (n < 0) { perror(wal_path); exit(1); }
+        printf("Replayed %d log records from %s\n", n, wal_path);
+    }
+
+    // One metrics shard per reactor
+    if (metrics_init(reactors) < 0) { perror("metrics_init"); exit(1); }
+    metrics_add_gauge("accounts", "Open accounts.", ledger_account_count);
+    metrics_add_gauge("queue_depth", "Ready events the reactors are working through.",
+                      queue_depth_gauge);
+    if (metrics_port && metrics_serve(metrics_port) < 0) {
+        perror("metrics_serve"); exit(1);
+    }
+
+    int *listeners = malloc(reactors * sizeof(int));
+    if (!listeners) { perror("malloc"); exit(1); }
+    for (long i = 0; i < reactors; i++) listeners[i] = create_listener();
+
+    printf("Async Bank Server (epoll, %ld reactor%s) listening on port %d...\n",
+           reactors, reactors == 1 ? "" : "s", PORT);
+
+    // Reactors 1..N-1 get their own threads; reactor 0 runs on the main thread
+    for (long i = 1; i < reactors; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, reactor_main, (void*)(intptr_t)listeners[i]) != 0) {
+            perror("pthread_create"); exit(1);
+        }
+        pthread_detach(tid);
+    }
+    reactor_main((void*)(intptr_t)listeners[0]);
     return 0;
 }
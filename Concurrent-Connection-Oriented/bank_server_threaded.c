@@ -1,44 +1,232 @@
 /*
  * bank_server_threaded.c
- * Concurrent, connection-oriented server using POSIX threads
+ * Concurrent, connection-oriented server using a fixed pool of POSIX threads
+ *
+ * Workers take readiness events, not whole connections. The main thread
+ * accepts and keeps every client socket in one epoll set, armed with
+ * EPOLLONESHOT; when one becomes ready it goes into a bounded queue that a
+ * fixed number of workers serve. A worker reads once, answers the complete
+ * lines it got, flushes and re-arms the socket, so idle clients hold no
+ * worker. When the queue is full (every worker busy and -q ready connections
+ * waiting) new clients are told "ERR busy" and closed.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "command_processor.h"
+#include "connection.h"
+#include "work_queue.h"
+#include "ledger.h"
+#include "snapshot.h"
+#include "log.h"
+#include "metrics.h"
 
 #define PORT     3333
-#define BACKLOG  10
-#define BUF_SZ   256
+#define BACKLOG  128
+#define MAX_EVENTS           256
+#define DEFAULT_WORKERS      16
+#define DEFAULT_QUEUE_DEPTH  256
+#define WORKER_STACK_SZ      (256 * 1024)   // plenty for process_command()
 
-void *handle_client(void *arg) {
-    int client_fd = *(int*)arg;
-    free(arg);
-    char buf[BUF_SZ];
-    ssize_t n;
+static WorkQueue pending;   // ready connections waiting for a worker
+static int epfd;
 
-    while ((n = read(client_fd, buf, BUF_SZ-1)) > 0) {
-        buf[n] = '\0';
-        process_command(client_fd, buf);
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void close_client(Connection *c) {
+    metrics_connection_closed();
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    conn_destroy(c);
+    free(c);
+}
+
+// Hand the socket back to epoll. After this another worker may own c.
+static void rearm(Connection *c, uint32_t events) {
+    struct epoll_event ev;
+    ev.events   = events | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        LOG_WARN("epoll_ctl: %m");
+        close_client(c);
     }
-    close(client_fd);
+}
+
+//
+// One turn of a worker on a ready connection: at most one read, every
+// complete request it buffered (flushing whenever the replies pass the
+// high-water mark), one flush, then re-arm. Bytes still in the socket make
+// the level-triggered event fire again, so a busy client cannot keep a
+// worker to itself. A flush the socket could not take re-arms for EPOLLOUT
+// only, which stops reading until the client catches up.
+//
+static void serve_ready(Connection *c) {
+    int filled = 0;
+    while (1) {
+        int r = c->closing ? DISPATCH_CLOSE : dispatch_input(c);
+        if (r == DISPATCH_CLOSE) {
+            c->closing = 1;   // QUIT: close once the replies are out
+        } else if (r == DISPATCH_NEED_MORE && !filled) {
+            filled = 1;
+            ssize_t n = conn_fill(c);
+            if (n > 0) continue;
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                c->closing = 1;   // EOF or hard error: answer what was read, then close
+        } else if (r == DISPATCH_DONE && conn_pending(c) <= CONN_OUT_HIGH) {
+            continue;
+        }
+        int rc = commit_and_flush(c);
+        if (rc < 0 || (c->closing && rc == 0)) {
+            close_client(c);
+            return;
+        }
+        if (rc == 1) {
+            rearm(c, EPOLLOUT);
+            return;
+        }
+        if (r != DISPATCH_DONE) break;
+    }
+    rearm(c, EPOLLIN);
+}
+
+static long queue_depth_gauge(void) {
+    return wq_depth(&pending);
+}
+
+static void *worker_main(void *arg) {
+    (void)arg;
+    while (1) serve_ready(wq_pop(&pending));
     return NULL;
 }
 
-int main() {
+//
+// Out of descriptors, accept() fails but leaves the connection in the
+// backlog, and the level-triggered listener would wake us for it again at
+// once. Give up the spare descriptor kept for this, take the connection and
+// close it, then put the spare back.
+//
+static void shed_client(int listen_fd, int *spare_fd) {
+    if (*spare_fd >= 0) close(*spare_fd);
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd >= 0) close(fd);
+    *spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+static void accept_client(int listen_fd, int *spare_fd) {
+    int client_fd = accept(listen_fd, NULL, NULL);
+    if (client_fd < 0) {
+        if (errno == EMFILE || errno == ENFILE) {
+            LOG_WARN("accept: %m; closing the new connection");
+            shed_client(listen_fd, spare_fd);
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            LOG_WARN("accept: %m");
+        }
+        return;
+    }
+    // Load shedding: refuse now rather than let ready work pile up unbounded
+    if (wq_depth(&pending) >= pending.capacity) {
+        // Best effort: the client is dropped either way
+        if (write(client_fd, "ERR busy\n", 9) != 9)
+            LOG_DEBUG("busy reply: %m");
+        close(client_fd);
+        return;
+    }
+    Connection *c = malloc(sizeof(Connection));
+    if (!c || set_nonblocking(client_fd) < 0) {
+        free(c);
+        close(client_fd);
+        return;
+    }
+    conn_init(c, client_fd);
+    struct epoll_event ev;
+    ev.events   = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+        LOG_WARN("epoll_ctl: %m");
+        conn_destroy(c);
+        close(client_fd);
+        free(c);
+        return;
+    }
+    metrics_connection_opened();
+}
+
+//
+// Every idle client holds a descriptor, and the usual soft limit is 1024:
+// go up to the hard limit.
+//
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == rl.rlim_max) return;
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0) LOG_WARN("setrlimit(RLIMIT_NOFILE): %m");
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-t workers] [-q queue_depth] [-w wal_file [-c secs]] [-m port] [-v]\n"
+                    "  -t  worker threads (default %d)\n"
+                    "  -q  ready connections that may wait for a worker (default %d)\n"
+                    "  -w  write-ahead log: replay it at startup, log every change to it\n"
+                    "  -c  seconds between background snapshots of the table (0 = never; default %d)\n"
+                    "  -m  port of the Prometheus metrics endpoint (0 = none; default %d)\n"
+                    "  -v  log DEBUG traces (SIGUSR1 / SIGUSR2 raise / lower the level later)\n",
+            prog, DEFAULT_WORKERS, DEFAULT_QUEUE_DEPTH, SNAPSHOT_DEFAULT_INTERVAL,
+            METRICS_DEFAULT_PORT);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
     int listen_fd;
     struct sockaddr_in serv_addr;
+    int workers = DEFAULT_WORKERS, queue_depth = DEFAULT_QUEUE_DEPTH;
+    const char *wal_path = NULL;
+    int snapshot_secs = SNAPSHOT_DEFAULT_INTERVAL;
+    int log_lvl = LOG_LEVEL_INFO;
+    int metrics_port = METRICS_DEFAULT_PORT;
+
+    int opt_ch;
+    while ((opt_ch = getopt(argc, argv, "t:q:w:c:m:v")) != -1) {
+        switch (opt_ch) {
+            case 't': workers     = atoi(optarg); break;
+            case 'q': queue_depth = atoi(optarg); break;
+            case 'w': wal_path    = optarg; break;
+            case 'c': snapshot_secs = atoi(optarg); break;
+            case 'm': metrics_port = atoi(optarg); break;
+            case 'v': log_lvl = LOG_LEVEL_DEBUG; break;
+            default:  usage(argv[0]);
+        }
+    }
+    if (workers < 1 || queue_depth < 1) usage(argv[0]);
+    log_start(log_lvl);
+    raise_fd_limit();
+
+    // Workers waiting on the log at the same time share one fdatasync
+    if (wal_path) {
+        int n = ledger_recover(wal_path, snapshot_secs);
+        if (n < 0) { perror(wal_path); exit(1); }
+        printf("Replayed %d log records from %s\n", n, wal_path);
+    }
 
     if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket"); exit(1);
     }
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = INADDR_ANY;
@@ -50,20 +238,65 @@ int main() {
     if (listen(listen_fd, BACKLOG) < 0) {
         perror("listen"); exit(1);
     }
-    printf("Threaded Bank Server listening on port %d...\n", PORT);
+    if (set_nonblocking(listen_fd) < 0) {
+        perror("fcntl"); exit(1);
+    }
+    int spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (spare_fd < 0) { perror("/dev/null"); exit(1); }
+
+    // The listener is tagged with a NULL ptr and stays level-triggered
+    if ((epfd = epoll_create1(0)) < 0) {
+        perror("epoll_create1"); exit(1);
+    }
+    struct epoll_event lev;
+    lev.events   = EPOLLIN;
+    lev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &lev) < 0) {
+        perror("epoll_ctl"); exit(1);
+    }
 
+    if (wq_init(&pending, queue_depth) < 0) {
+        perror("wq_init"); exit(1);
+    }
+
+    // One metrics shard per worker
+    if (metrics_init(workers) < 0) {
+        perror("metrics_init"); exit(1);
+    }
+    metrics_add_gauge("accounts", "Open accounts.", ledger_account_count);
+    metrics_add_gauge("queue_depth", "Ready connections waiting for a worker.", queue_depth_gauge);
+    if (metrics_port && metrics_serve(metrics_port) < 0) {
+        perror("metrics_serve"); exit(1);
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_STACK_SZ);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, worker_main, NULL) != 0) {
+            perror("pthread_create"); exit(1);
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    printf("Threaded Bank Server listening on port %d (%d workers, queue %d)...\n",
+           PORT, workers, queue_depth);
+
+    // A ready client is disarmed (EPOLLONESHOT) until its worker re-arms it,
+    // so it is queued once; the push waits for room rather than lose it
+    struct epoll_event events[MAX_EVENTS];
     while (1) {
-        struct sockaddr_in client_addr;
-        socklen_t addrlen = sizeof(client_addr);
-        int *client_fd = malloc(sizeof(int));
-        if ((*client_fd = accept(listen_fd, (struct sockaddr*)&client_addr, &addrlen)) < 0) {
-            perror("accept");
-            free(client_fd);
-            continue;
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait"); exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            Connection *c = events[i].data.ptr;
+            if (!c) accept_client(listen_fd, &spare_fd);
+            else    wq_push(&pending, c);
         }
-        pthread_t tid;
-        pthread_create(&tid, NULL, handle_client, client_fd);
-        pthread_detach(tid);
     }
     close(listen_fd);
     return 0;
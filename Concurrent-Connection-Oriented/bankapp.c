@@ -1,35 +1,65 @@
 #include "bankapp.h"
+#include "ledger.h"
+#include "log.h"
 #include <time.h>
 
-// Define globals
-Account *head = NULL;
-int account_number_seed = 1001;
-
-// Helper: find an account by number+PIN
+// Helper: find an account by number+PIN (O(1) expected via the hash index;
+// the PIN check is constant-time, and free for a session that already
+// proved it, see auth.c). SESSION_PIN names the bound connection's LOGIN
+// account, which is returned with neither a lookup nor a PIN check while
+// its record has not been closed since. Callers hold the account's stripe,
+// or check ledger->index_seq afterwards (bankapp_network.c), which is what
+// makes the generation check stick.
 Account *find_account(int acct_no, int pin) {
-    Account *cur = head;
-    while (cur) {
-        if (cur->account_number == acct_no && cur->pin == pin) {
-            return cur;
-        }
-        cur = cur->next;
-    }
-    return NULL;
+    if (pin == SESSION_PIN) {
+        const AuthCache *s = auth_session();
+        Account *acc = s ? s->login : NULL;
+        if (acc && s->login_acct == acct_no && acc->generation == s->login_generation)
+            return acc;
+        return NULL;
+    }
+    Account *acc = index_lookup(&ledger->index, acct_no);
+    if (!auth_verify(acct_no, pin, acc ? &acc->details->pin : NULL)) return NULL;
+    return acc;
+}
+
+// Helper: make sure the next record_transaction() on acc keeps its history
+// entry. Returns -1 if there is no room, and the caller refuses the change
+// instead of moving money without an audit record. Call under the stripe,
+// before logging or changing anything.
+int reserve_transaction(Account *acc) {
+    if (history_reserve(&acc->details->history) == 0) return 0;
+    static int warned;
+    if (!warned++) LOG_WARN("history: chunk pool exhausted, changes refused");
+    return -1;
 }
 
-// Helper: record a transaction (keeps only last MAX_TRANS)
-void record_transaction(Account *acc, const char *type, int amount) {
-    // Shift older transactions if at max
-    if (acc->trans_count == MAX_TRANS) {
-        for (int i = 1; i < MAX_TRANS; i++) {
-            acc->transactions[i - 1] = acc->transactions[i];
-        }
-        acc->trans_count--;
-    }
-    // Append new
-    strcpy(acc->transactions[acc->trans_count].type, type);
-    acc->transactions[acc->trans_count].amount = amount;
-    acc->trans_count++;
+// Helper: record a transaction. O(1): the mini statement is a ring of the
+// last MAX_TRANS entries, and the full history only ever appends. While
+// lock-free readers may be about, the caller has acc->version odd (ledger.h).
+// Only log replay, which cannot refuse a change, records without
+// reserve_transaction() first.
+void record_transaction(Account *acc, int kind, int amount) {
+    AccountDetails *d = acc->details;
+    Transaction t = { .amount = amount, .kind = (uint8_t)kind };
+    d->recent[d->trans_total % MAX_TRANS] = t;
+    d->trans_total++;
+    if (history_append(&d->history, t) < 0) {
+        static int warned;
+        if (!warned++) LOG_WARN("history: chunk pool exhausted, entries dropped");
+    }
+}
+
+// Helper: the last up to MAX_TRANS transactions, oldest first; returns the count.
+// A lock-free reader can catch the record being reallocated, details not
+// yet set; it finds no entries and retries.
+int mini_statement(const Account *acc, Transaction out[MAX_TRANS]) {
+    const AccountDetails *d = acc->details;
+    if (!d) return 0;
+    int n = d->trans_total < MAX_TRANS ? (int)d->trans_total : MAX_TRANS;
+    uint32_t first = d->trans_total - n;
+    for (int i = 0; i < n; i++) out[i] = d->recent[(first + i) % MAX_TRANS];
+    return n;
 }
 
 // Display the console menu
@@ -55,29 +85,29 @@ void open_account() {
     printf("Enter account type (SAVINGS/CURRENT): ");
     scanf("%9s", type);
 
-    int new_acc_no = account_number_seed++;
-    int new_pin = rand() % 9000 + 1000;
+    int new_acc_no = atomic_fetch_add(&ledger->account_number_seed, 1);
+    int new_pin = pin_generate();
 
-    Account *acc = (Account*)malloc(sizeof(Account));
+    Account *acc = new_pin < 0 ? NULL : ledger_alloc_account();
     if (!acc) {
         printf("Allocation error!\n");
         return;
     }
     acc->account_number = new_acc_no;
-    acc->pin = new_pin;
-    strcpy(acc->name, name);
-    strcpy(acc->nid, nid);
-    strcpy(acc->account_type, type);
+    if (pin_set(&acc->details->pin, new_pin) < 0) {
+        printf("Allocation error!\n");
+        ledger_free_account(acc);
+        return;
+    }
+    strcpy(acc->details->name, name);
+    strcpy(acc->details->nid, nid);
+    strcpy(acc->details->account_type, type);
     acc->balance = MIN_BALANCE;
-    acc->trans_count = 0;
-    acc->next = NULL;
 
-    if (head == NULL) {
-        head = acc;
-    } else {
-        Account *cur = head;
-        while (cur->next) cur = cur->next;
-        cur->next = acc;
+    if (index_insert(&ledger->index, new_acc_no, acc) < 0) {
+        printf("Allocation error!\n");
+        ledger_free_account(acc);
+        return;
     }
 
     printf("Account created successfully!\n");
@@ -102,8 +132,12 @@ void deposit() {
         printf("Amount must be at least %d!\n", MIN_WITHDRAW);
         return;
     }
+    if (reserve_transaction(acc) < 0) {
+        printf("No room left for the transaction history!\n");
+        return;
+    }
     acc->balance += amt;
-    record_transaction(acc, "DEPOSIT", amt);
+    record_transaction(acc, TXN_DEPOSIT, amt);
     printf("Deposit successful! New balance: %d\n", acc->balance);
 }
 
@@ -129,8 +163,12 @@ void withdraw() {
         printf("Cannot withdraw. Minimum balance %d must be maintained!\n", MIN_BALANCE);
         return;
     }
+    if (reserve_transaction(acc) < 0) {
+        printf("No room left for the transaction history!\n");
+        return;
+    }
     acc->balance -= amt;
-    record_transaction(acc, "WITHDRAW", amt);
+    record_transaction(acc, TXN_WITHDRAW, amt);
     printf("Withdrawal successful! New balance: %d\n", acc->balance);
 }
 
@@ -161,13 +199,15 @@ void statement() {
         printf("Invalid account or PIN!\n");
         return;
     }
-    if (acc->trans_count == 0) {
+    Transaction txns[MAX_TRANS];
+    int n = mini_statement(acc, txns);
+    if (n == 0) {
         printf("No transactions yet.\n");
         return;
     }
-    printf("Last %d transactions:\n", acc->trans_count);
-    for (int i = 0; i < acc->trans_count; i++) {
-        printf("  %s: %d\n", acc->transactions[i].type, acc->transactions[i].amount);
+    printf("Last %d transactions:\n", n);
+    for (int i = 0; i < n; i++) {
+        printf("  %s: %d\n", txn_kind_name(txns[i].kind), txns[i].amount);
     }
 }
 
@@ -178,20 +218,12 @@ void close_account() {
     scanf("%d", &acct_no);
     printf("Enter PIN: ");
     scanf("%d", &pin);
-    Account *prev = NULL, *cur = head;
-    while (cur) {
-        if (cur->account_number == acct_no && cur->pin == pin) {
-            if (prev) {
-                prev->next = cur->next;
-            } else {
-                head = cur->next;
-            }
-            free(cur);
-            printf("Account closed successfully.\n");
-            return;
-        }
-        prev = cur;
-        cur = cur->next;
-    }
-    printf("Invalid account or PIN!\n");
+    Account *acc = find_account(acct_no, pin);
+    if (!acc) {
+        printf("Invalid account or PIN!\n");
+        return;
+    }
+    index_remove(&ledger->index, acct_no);
+    ledger_free_account(acc);
+    printf("Account closed successfully.\n");
 }
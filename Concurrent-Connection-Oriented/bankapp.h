@@ -4,32 +4,50 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "account_index.h"
+#include "history.h"
+#include "auth.h"
 
 #define MIN_BALANCE   1000
 #define MIN_WITHDRAW   500
-#define MAX_TRANS      5
+#define MAX_TRANS      5     // entries in the mini statement
+#define STATEMENT_PAGE_MAX  100   // most entries one paged STATEMENT returns
+#define BATCH_MAX     1024   // most operations in one BATCH
+#define SESSION_PIN     -1   // as a PIN: "the account this connection is logged in to"
+#define REFUSED_PIN      0   // matches no account (PINs are 1000-9999)
 
-typedef struct Transaction {
-    char type[10];   // "DEPOSIT" or "WITHDRAW"
-    int  amount;
-} Transaction;
+// A PIN as a client sent it. SESSION_PIN is the server's own marker, set only
+// when it picks the LOGIN account; sent by a client it fails like a wrong PIN.
+static inline int client_pin(int pin) {
+    return pin == SESSION_PIN ? REFUSED_PIN : pin;
+}
 
-typedef struct Account {
-    int account_number;
-    int pin;
+// Cold part of an account: identity, PIN hash and history. Only OPEN,
+// STATEMENT, a PIN check the session cache cannot answer (and snapshots)
+// look at it, so it lives apart from the hot records.
+typedef struct AccountDetails {
     char name[50];
     char nid[20];
     char account_type[10];
+    PinHash pin;
+    Transaction recent[MAX_TRANS];   // ring: entry i is at recent[i % MAX_TRANS]
+    uint32_t trans_total;            // entries ever recorded
+    History history;                 // all of them, for paged statements
+} AccountDetails;
+
+// Hot part: everything a BALANCE / DEPOSIT / WITHDRAW touches, in 32 bytes
+// (two records per cache line, packed densely by the ledger's slab).
+typedef struct Account {
+    int account_number;
     int balance;
-    Transaction transactions[MAX_TRANS];
-    int trans_count;
-    struct Account *next;
+    atomic_uint version;       // seqlock for lock-free readers: odd while a change is made
+    uint32_t generation;       // bumped by CLOSE, kept across reuse: LOGIN handles check it
+    uint64_t last_lsn;         // WAL position of the last logged change
+    AccountDetails *details;
 } Account;
 
-// Global head pointer and seed for account numbers
-extern Account *head;
-extern int account_number_seed;
-
 // Core, “pure‑C” functions (interactive console version)
 void open_account();
 void close_account();
@@ -38,7 +56,9 @@ void withdraw();
 void balance();
 void statement();
 Account *find_account(int acct_no, int pin);
-void record_transaction(Account *acc, const char *type, int amount);
+int  reserve_transaction(Account *acc);
+void record_transaction(Account *acc, int kind, int amount);
+int  mini_statement(const Account *acc, Transaction out[MAX_TRANS]);
 void display_menu();
 
 // Network‑wrapper function prototypes (used by the TCP server)
@@ -51,7 +71,23 @@ void open_account_network(const char *name,
 int  deposit_network(int acct_no, int pin, int amount);
 int  withdraw_network(int acct_no, int pin, int amount);
 int  balance_network(int acct_no, int pin);
-char* statement_network(int acct_no, int pin);
+int  statement_entries_network(int acct_no, int pin, Transaction out[MAX_TRANS]);
+int  statement_page_network(int acct_no, int pin, uint32_t offset, uint32_t limit,
+                            Transaction out[STATEMENT_PAGE_MAX], uint32_t *total);
+int  transfer_network(int from_acct, int pin, int to_acct, int amount);
+
+// One operation of a BATCH: kind is TXN_DEPOSIT or TXN_WITHDRAW (anything
+// else fails); result is set to the new balance, or -1
+typedef struct BatchOp {
+    int32_t acct_no;
+    int32_t pin;
+    int32_t amount;
+    int32_t result;
+    uint8_t kind;
+} BatchOp;
+
+int  batch_network(BatchOp *ops, int n);
 int  close_account_network(int acct_no, int pin);
+Account *login_network(int acct_no, int pin, uint32_t *generation);
 
 #endif // BANKAPP_H
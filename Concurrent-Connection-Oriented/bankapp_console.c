@@ -1,11 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
 #include "bankapp.h"
 
 int main() {
     int choice;
-    srand((unsigned)time(NULL));
 
     do {
         display_menu();
@@ -2,13 +2,62 @@
 #include <stdlib.h>
 #include <string.h>
 #include "bankapp.h"
+#include "ledger.h"
+#include "wal.h"
+#include "log.h"
 
-// Bring in the global list and seed from bankapp.c
-extern Account *head;
-extern int account_number_seed;
+// Every wrapper holds the account's stripe lock for its whole read-modify-write
+// (OPEN/CLOSE take all stripes), so the same code is safe from many threads and,
+// with a shared ledger, from many processes. See ledger.c.
+//
+// With a write-ahead log open, each change is appended to it while that lock
+// is still held, so the log orders changes to an account exactly as they were
+// applied. Whatever a request reads or writes becomes its commit dependency
+// (wal.h); the servers hold the reply until the log is durable that far.
+//
+// BALANCE and STATEMENT are the exception: they take no lock and read under
+// the account's seqlock instead (ledger.h), so readers of a busy account
+// neither wait for its writers nor hold them up. Writers log first and then
+// apply the change inside acc->version's odd window, which stays short.
+
+// Append one DEPOSIT/WITHDRAW/CLOSE record; returns its LSN (0 without a log)
+static uint64_t log_change(int type, int acct_no, int value) {
+    if (!wal) return 0;
+    WalRecord rec;
+    memset(&rec, 0, WAL_SMALL_RECORD);
+    rec.type    = type;
+    rec.acct_no = acct_no;
+    rec.value   = value;
+    return wal_append(&rec);
+}
+
+static uint64_t log_transfer(int from_acct, int to_acct, int amount) {
+    if (!wal) return 0;
+    WalRecord rec;
+    memset(&rec, 0, WAL_TRANSFER_RECORD);
+    rec.type    = WAL_TRANSFER;
+    rec.acct_no = from_acct;
+    rec.value   = amount;
+    rec.to_acct = to_acct;
+    return wal_append(&rec);
+}
+
+static uint64_t log_open(const Account *acc) {
+    if (!wal) return 0;
+    WalRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type    = WAL_OPEN_HASHED;
+    rec.acct_no = acc->account_number;
+    memcpy(rec.pin_salt, acc->details->pin.salt, sizeof(rec.pin_salt));
+    memcpy(rec.pin_hash, acc->details->pin.hash, sizeof(rec.pin_hash));
+    memcpy(rec.name, acc->details->name, sizeof(rec.name));
+    memcpy(rec.nid, acc->details->nid, sizeof(rec.nid));
+    memcpy(rec.account_type, acc->details->account_type, sizeof(rec.account_type));
+    return wal_append(&rec);
+}
 
 //
-// 1) Create an account (prepending to the list for simplicity):
+// 1) Create an account and register it in the account index:
 //
 void open_account_network(const char *name,
                           const char *nid,
@@ -16,35 +65,40 @@ void open_account_network(const char *name,
                           int *acct_no,
                           int *pin)
 {
-    int new_acc_no = account_number_seed++;
-    int new_pin    = rand() % 9000 + 1000;  // 4‑digit PIN
+    int new_acc_no = atomic_fetch_add(&ledger->account_number_seed, 1);
+    int new_pin    = pin_generate();        // 4‑digit PIN
 
-    Account *acc = (Account*)malloc(sizeof(Account));
-    if (!acc) {
+    Account *acc = new_pin < 0 ? NULL : ledger_alloc_account();
+    if (!acc || pin_set(&acc->details->pin, new_pin) < 0) {
+        if (acc) ledger_free_account(acc);
         *acct_no = -1;
         *pin     = -1;
         return;
     }
 
     acc->account_number = new_acc_no;
-    acc->pin            = new_pin;
-    strncpy(acc->name, name, sizeof(acc->name)-1);
-    acc->name[sizeof(acc->name)-1] = '\0';
-    strncpy(acc->nid, nid, sizeof(acc->nid)-1);
-    acc->nid[sizeof(acc->nid)-1] = '\0';
-    strncpy(acc->account_type, type, sizeof(acc->account_type)-1);
-    acc->account_type[sizeof(acc->account_type)-1] = '\0';
-    acc->balance     = MIN_BALANCE;
-    acc->trans_count = 0;
-
-    // Prepend to list
-    acc->next = head;
-    head = acc;
-
-    // Debug print
-    printf("[DEBUG] open_account_network: now head = %d, PIN = %d\n",
-           acc->account_number, acc->pin);
-    fflush(stdout);
+    AccountDetails *d = acc->details;
+    strncpy(d->name, name, sizeof(d->name)-1);
+    d->name[sizeof(d->name)-1] = '\0';
+    strncpy(d->nid, nid, sizeof(d->nid)-1);
+    d->nid[sizeof(d->nid)-1] = '\0';
+    strncpy(d->account_type, type, sizeof(d->account_type)-1);
+    d->account_type[sizeof(d->account_type)-1] = '\0';
+    acc->balance   = MIN_BALANCE;
+
+    // The record is fully built before it becomes reachable
+    ledger_lock_all();
+    int rc = index_insert(&ledger->index, new_acc_no, acc);
+    if (rc == 0) acc->last_lsn = log_open(acc);
+    ledger_unlock_all();
+    if (rc < 0) {
+        ledger_free_account(acc);
+        *acct_no = -1;
+        *pin     = -1;
+        return;
+    }
+
+    LOG_DEBUG("open acct=%d", new_acc_no);
 
     *acct_no = new_acc_no;
     *pin     = new_pin;
@@ -55,29 +109,35 @@ void open_account_network(const char *name,
 //
 int deposit_network(int acct_no, int pin, int amount)
 {
-    printf("[DEBUG] Trying deposit_network( acct_no=%d, pin=%d, amount=%d )\n",
-           acct_no, pin, amount);
-    fflush(stdout);
-
     if (amount < MIN_WITHDRAW) {
-        printf("[DEBUG]  -> amount < MIN_WITHDRAW (%d)\n", MIN_WITHDRAW);
-        fflush(stdout);
+        LOG_DEBUG("deposit acct=%d amount=%d refused=below_minimum", acct_no, amount);
         return -1;
     }
 
+    ledger_lock_account(acct_no);
     Account *acc = find_account(acct_no, pin);
     if (!acc) {
-        printf("[DEBUG]  -> find_account returned NULL!\n");
-        fflush(stdout);
+        ledger_unlock_account(acct_no);
+        LOG_DEBUG("deposit acct=%d amount=%d refused=auth", acct_no, amount);
+        return -1;
+    }
+    if (reserve_transaction(acc) < 0) {
+        ledger_unlock_account(acct_no);
+        LOG_DEBUG("deposit acct=%d amount=%d refused=history_full", acct_no, amount);
         return -1;
     }
 
+    uint64_t lsn = log_change(WAL_DEPOSIT, acct_no, amount);
+    seq_write_begin(&acc->version);
     acc->balance += amount;
-    record_transaction(acc, "DEPOSIT", amount);
-    printf("[DEBUG]  -> New balance = %d\n", acc->balance);
-    fflush(stdout);
+    record_transaction(acc, TXN_DEPOSIT, amount);
+    acc->last_lsn = lsn;
+    seq_write_end(&acc->version);
+    int new_bal = acc->balance;
+    ledger_unlock_account(acct_no);
+    LOG_DEBUG("deposit acct=%d amount=%d balance=%d", acct_no, amount, new_bal);
 
-    return acc->balance;
+    return new_bal;
 }
 
 //
@@ -85,19 +145,203 @@ int deposit_network(int acct_no, int pin, int amount)
 //
 int withdraw_network(int acct_no, int pin, int amount)
 {
-    Account *acc = find_account(acct_no, pin);
-    if (!acc) return -1;  // invalid acct or PIN
-
     if (amount < MIN_WITHDRAW) {
         return -1;  // withdraw must be at least MIN_WITHDRAW
     }
-    if (acc->balance - amount < MIN_BALANCE) {
-        return -1;  // can’t go below MIN_BALANCE
+
+    ledger_lock_account(acct_no);
+    Account *acc = find_account(acct_no, pin);
+    if (acc) wal_note_dependency(acc->last_lsn);   // even a refusal reveals the balance
+    if (!acc || acc->balance - amount < MIN_BALANCE || reserve_transaction(acc) < 0) {
+        ledger_unlock_account(acct_no);
+        return -1;  // invalid acct/PIN, can’t go below MIN_BALANCE, or no room for history
     }
 
+    uint64_t lsn = log_change(WAL_WITHDRAW, acct_no, amount);
+    seq_write_begin(&acc->version);
     acc->balance -= amount;
-    record_transaction(acc, "WITHDRAW", amount);
-    return acc->balance;
+    record_transaction(acc, TXN_WITHDRAW, amount);
+    acc->last_lsn = lsn;
+    seq_write_end(&acc->version);
+    int new_bal = acc->balance;
+    ledger_unlock_account(acct_no);
+    return new_bal;
+}
+
+//
+// 3b) Transfer: move `amount` from one account (PIN checked, same rules as a
+//     withdrawal) to another, atomically: both stripes are held across the
+//     check, both updates and the single log record, so no other request,
+//     CLOSE included, sees or causes a half-done transfer. Returns the
+//     source's new balance, or -1:
+//
+int transfer_network(int from_acct, int pin, int to_acct, int amount)
+{
+    if (amount < MIN_WITHDRAW || from_acct == to_acct) {
+        return -1;
+    }
+
+    ledger_lock_pair(from_acct, to_acct);
+    Account *from = find_account(from_acct, pin);
+    Account *to   = index_lookup(&ledger->index, to_acct);
+    if (from) wal_note_dependency(from->last_lsn);
+    if (!from || !to || from->balance - amount < MIN_BALANCE ||
+        reserve_transaction(from) < 0 || reserve_transaction(to) < 0) {
+        ledger_unlock_pair(from_acct, to_acct);
+        return -1;
+    }
+
+    uint64_t lsn = log_transfer(from_acct, to_acct, amount);
+    seq_write_begin(&from->version);
+    seq_write_begin(&to->version);
+    from->balance -= amount;
+    to->balance   += amount;
+    record_transaction(from, TXN_TRANSFER_OUT, amount);
+    record_transaction(to, TXN_TRANSFER_IN, amount);
+    from->last_lsn = to->last_lsn = lsn;
+    seq_write_end(&to->version);
+    seq_write_end(&from->version);
+    int new_bal = from->balance;
+    ledger_unlock_pair(from_acct, to_acct);
+    return new_bal;
+}
+
+//
+// 3c) Batch: apply n DEPOSIT / WITHDRAW operations, setting each op's result
+//     as the single-op calls would. Ops are bucketed by lock stripe and each
+//     stripe is locked once for all of its ops, which run in submission
+//     order, so ops on one account see each other's effects. Log records go
+//     out in runs under one log lock each, and the caller's single commit
+//     wait covers them all. Ops are independent: a failed one undoes
+//     nothing. Returns how many succeeded:
+//
+#define BATCH_LOG_RUN  64
+
+// Every account in a run gets the run's last LSN. Its own records are all at
+// or below that and its next change is logged above it, which is all the
+// replay skip rule needs. Accounts stay odd (lock-free readers wait) from
+// their first change in the run until they have that LSN; one that is in the
+// run more than once is ended once. Returns 0 (the new run length).
+static int log_run(WalRecord *run, Account **run_acc, int nrun) {
+    if (nrun == 0) return 0;
+    uint64_t lsn = wal_append_many(run, nrun);
+    for (int j = 0; j < nrun; j++) run_acc[j]->last_lsn = lsn;
+    for (int j = 0; j < nrun; j++)
+        if (atomic_load_explicit(&run_acc[j]->version, memory_order_relaxed) & 1)
+            seq_write_end(&run_acc[j]->version);
+    return 0;
+}
+
+int batch_network(BatchOp *ops, int n)
+{
+    // Stable counting sort of op indices by stripe
+    int first[LEDGER_STRIPES + 1] = { 0 };
+    uint16_t order[BATCH_MAX];
+    if (n > BATCH_MAX) n = BATCH_MAX;
+    for (int i = 0; i < n; i++) first[ledger_stripe(ops[i].acct_no) + 1]++;
+    for (int s = 0; s < LEDGER_STRIPES; s++) first[s + 1] += first[s];
+    int next[LEDGER_STRIPES];
+    memcpy(next, first, sizeof(next));
+    for (int i = 0; i < n; i++) order[next[ledger_stripe(ops[i].acct_no)]++] = i;
+
+    WalRecord run[BATCH_LOG_RUN];
+    Account  *run_acc[BATCH_LOG_RUN];
+    int done = 0;
+    for (int s = 0; s < LEDGER_STRIPES; s++) {
+        if (first[s] == first[s + 1]) continue;
+        int nrun = 0;
+        int lock_acct = ops[order[first[s]]].acct_no;
+        ledger_lock_account(lock_acct);
+        for (int k = first[s]; k < first[s + 1]; k++) {
+            BatchOp *op = &ops[order[k]];
+            Account *acc = find_account(op->acct_no, op->pin);
+            op->result = -1;
+            if (!acc) continue;
+            wal_note_dependency(acc->last_lsn);
+            if (op->amount < MIN_WITHDRAW) continue;
+            if (op->kind != TXN_DEPOSIT &&
+                !(op->kind == TXN_WITHDRAW && acc->balance - op->amount >= MIN_BALANCE))
+                continue;
+            if (reserve_transaction(acc) < 0) continue;
+            seq_write_begin(&acc->version);   // a no-op if already in this run
+            acc->balance += op->kind == TXN_DEPOSIT ? op->amount : -op->amount;
+            record_transaction(acc, op->kind, op->amount);
+            op->result = acc->balance;
+            done++;
+
+            if (!wal) {
+                seq_write_end(&acc->version);
+                continue;
+            }
+            WalRecord *rec = &run[nrun];
+            memset(rec, 0, WAL_SMALL_RECORD);
+            rec->type    = op->kind == TXN_DEPOSIT ? WAL_DEPOSIT : WAL_WITHDRAW;
+            rec->acct_no = op->acct_no;
+            rec->value   = op->amount;
+            run_acc[nrun++] = acc;
+            if (nrun == BATCH_LOG_RUN) nrun = log_run(run, run_acc, nrun);
+        }
+        log_run(run, run_acc, nrun);
+        ledger_unlock_account(lock_acct);
+    }
+    return done;
+}
+
+//
+// find_account() without the stripe. The lookup may overlap an OPEN / CLOSE
+// (a slot mid-shift can pair the number with another account's record) and
+// the record may be on its way to reuse (details not yet set), which the
+// caller's check of ledger->index_seq catches. So the session's auth cache
+// is not touched here: *hashed says the PIN matched by hash, for the caller
+// to auth_remember() once the read has checked out.
+//
+static Account *find_account_unlocked(int acct_no, int pin, int *hashed) {
+    *hashed = 0;
+    if (pin == SESSION_PIN) return find_account(acct_no, pin);
+    Account *acc = index_lookup_concurrent(&ledger->index, acct_no);
+    const AccountDetails *d = acc ? acc->details : NULL;
+    int r = auth_check(acct_no, pin, d ? &d->pin : NULL);
+    *hashed = r == AUTH_HASHED;
+    return r ? acc : NULL;
+}
+
+//
+// Lock-free read for BALANCE / STATEMENT: the account is looked up and read
+// speculatively, and it all starts over if OPEN / CLOSE changed the index
+// or a writer changed the record meanwhile. Records live in slabs that are
+// never unmapped, so reading a stale one is harmless, and nothing read (the
+// PIN proof for the auth cache included) is used until both counters check
+// out. Returns 1 with *balance (and, given
+// `recent`, *n entries) set, 0 for a bad account / PIN, or -1 if writers
+// kept it too busy and the caller should take the stripe instead.
+//
+#define READ_ATTEMPTS  8
+
+static int read_unlocked(int acct_no, int pin, int *balance,
+                         Transaction recent[MAX_TRANS], int *n)
+{
+    for (int attempt = 0; attempt < READ_ATTEMPTS; attempt++) {
+        unsigned index_seq, version;
+        int hashed;
+        if (!seq_read_begin(&ledger->index_seq, &index_seq)) return -1;
+        Account *acc = find_account_unlocked(acct_no, pin, &hashed);
+        if (!acc) {
+            if (seq_read_retry(&ledger->index_seq, index_seq)) continue;
+            return 0;
+        }
+        if (!seq_read_begin(&acc->version, &version)) return -1;
+        int bal = acc->balance;
+        uint64_t lsn = acc->last_lsn;
+        if (recent) *n = mini_statement(acc, recent);
+        if (seq_read_retry(&acc->version, version) ||
+            seq_read_retry(&ledger->index_seq, index_seq))
+            continue;
+        if (hashed) auth_remember(acct_no, pin);
+        wal_note_dependency(lsn);
+        *balance = bal;
+        return 1;
+    }
+    return -1;
 }
 
 //
@@ -105,52 +349,97 @@ int withdraw_network(int acct_no, int pin, int amount)
 //
 int balance_network(int acct_no, int pin)
 {
+    int bal;
+    int found = read_unlocked(acct_no, pin, &bal, NULL, NULL);
+    if (found >= 0) return found ? bal : -1;
+
+    // Writers kept the account busy: read it under the stripe
+    ledger_lock_account(acct_no);
     Account *acc = find_account(acct_no, pin);
-    if (!acc) return -1;
-    return acc->balance;
+    bal = acc ? acc->balance : -1;
+    if (acc) wal_note_dependency(acc->last_lsn);
+    ledger_unlock_account(acct_no);
+    return bal;
 }
 
 //
-// 5) Statement: build a string listing the last up to MAX_TRANS transactions:
+// 5) Statement: copy the last up to MAX_TRANS transactions into out[], for
+//     the protocol layer to format; returns the count or -1:
 //
-char *statement_network(int acct_no, int pin)
+int statement_entries_network(int acct_no, int pin, Transaction out[MAX_TRANS])
 {
+    int bal, n;
+    int found = read_unlocked(acct_no, pin, &bal, out, &n);
+    if (found >= 0) return found ? n : -1;
+
+    ledger_lock_account(acct_no);
     Account *acc = find_account(acct_no, pin);
-    if (!acc) return NULL;
-
-    int needed = acc->trans_count * 32 + 1;
-    char *buf = (char*)malloc(needed);
-    if (!buf) return NULL;
-    buf[0] = '\0';
-
-    for (int i = 0; i < acc->trans_count; i++) {
-        char line[64];
-        snprintf(line, sizeof(line), "%s:%d\n",
-                 acc->transactions[i].type,
-                 acc->transactions[i].amount);
-        strncat(buf, line, needed - strlen(buf) - 1);
+    n = acc ? mini_statement(acc, out) : -1;
+    if (acc) wal_note_dependency(acc->last_lsn);
+    ledger_unlock_account(acct_no);
+    return n;
+}
+
+//
+// 5b) Statement page: copy up to `limit` (at most STATEMENT_PAGE_MAX) entries
+//     of the full history, starting `offset` entries after the oldest, and
+//     report the history length in *total; returns the count or -1. Under
+//     the stripe: a reader that raced an append could follow a chunk link
+//     not yet written, so the full history is not read lock-free:
+//
+int statement_page_network(int acct_no, int pin, uint32_t offset, uint32_t limit,
+                           Transaction out[STATEMENT_PAGE_MAX], uint32_t *total)
+{
+    if (limit > STATEMENT_PAGE_MAX) limit = STATEMENT_PAGE_MAX;
+
+    ledger_lock_account(acct_no);
+    Account *acc = find_account(acct_no, pin);
+    if (!acc) {
+        ledger_unlock_account(acct_no);
+        return -1;
     }
-    return buf;  // caller must free()
+    const History *h = &acc->details->history;
+    int n = (int)history_read(h, offset, limit, out);
+    *total = h->count;
+    wal_note_dependency(acc->last_lsn);
+    ledger_unlock_account(acct_no);
+    return n;
 }
 
 //
-// 6) Close account: unlink from list + free, return 0 on success or -1 on failure:
+// 6) Close account: drop from the index + free, return 0 on success or -1 on failure:
 //
 int close_account_network(int acct_no, int pin)
 {
-    Account *prev = NULL, *cur = head;
-    while (cur) {
-        if (cur->account_number == acct_no && cur->pin == pin) {
-            if (prev) {
-                prev->next = cur->next;
-            } else {
-                head = cur->next;
-            }
-            free(cur);
-            return 0;
-        }
-        prev = cur;
-        cur  = cur->next;
+    ledger_lock_all();
+    Account *acc = find_account(acct_no, pin);
+    if (!acc) {
+        ledger_unlock_all();
+        return -1;  // not found or bad PIN
     }
-    return -1;  // not found or bad PIN
+    index_remove(&ledger->index, acct_no);
+    acc->generation++;   // LOGIN handles to it go stale
+    log_change(WAL_CLOSE, acct_no, 0);
+    ledger_unlock_all();
+
+    // Locked users of the record are gone: we just held every stripe. Others
+    // may still look at it. Lock-free readers see index_seq moved and throw
+    // their read away, sessions see the new generation, and the slab memory
+    // stays mapped for either (ledger.c).
+    ledger_free_account(acc);
+    return 0;
+}
+
+//
+// 7) Login: check acct + PIN once and hand back the record with its current
+//     generation; the connection then acts on it through SESSION_PIN until
+//     a CLOSE bumps the generation. NULL on a bad acct/PIN:
+//
+Account *login_network(int acct_no, int pin, uint32_t *generation)
+{
+    ledger_lock_account(acct_no);
+    Account *acc = find_account(acct_no, pin);
+    if (acc) *generation = acc->generation;
+    ledger_unlock_account(acct_no);
+    return acc;
 }
@@ -0,0 +1,217 @@
+/*
+ * binary_protocol.c
+ * Decode binary request frames, call the *_network API, encode responses.
+ *
+ * Fields sit at fixed offsets, so decoding is a handful of loads and
+ * byte-swaps (no-ops on little-endian hosts) instead of sscanf/snprintf.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include "bankapp.h"
+#include "binary_protocol.h"
+#include "command_processor.h"
+#include "metrics.h"
+
+// Response scratch: header + the largest body (STATEMENT_PAGE or BATCH)
+#define BIN_PAGE_RESPONSE   (BIN_HEADER_SZ + 8 + STATEMENT_PAGE_MAX * 5)
+#define BIN_BATCH_RESPONSE  (BIN_HEADER_SZ + 4 + BIN_BATCH_MAX * 4)
+#define BIN_MAX_RESPONSE    (BIN_PAGE_RESPONSE > BIN_BATCH_RESPONSE ? \
+                             BIN_PAGE_RESPONSE : BIN_BATCH_RESPONSE)
+
+static int32_t get_i32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (int32_t)le32toh(v);
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    v = htole32(v);
+    memcpy(p, &v, 4);
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t)get_i32(p);
+}
+
+// n x { u8 kind, i32 amount }; returns the end of what was written
+static unsigned char *put_entries(unsigned char *p, const Transaction *txns, int n) {
+    for (int i = 0; i < n; i++) {
+        *p++ = txns[i].kind;   // TxnKind values match BinTxnKind
+        put_u32(p, (uint32_t)txns[i].amount);
+        p += 4;
+    }
+    return p;
+}
+
+// Copy a NUL-padded fixed field into a C string
+static void get_str(char *dst, const unsigned char *src, size_t width) {
+    memcpy(dst, src, width);
+    dst[width] = '\0';
+}
+
+static void send_frame(Connection *conn, unsigned char *resp, size_t len,
+                       uint8_t opcode, uint8_t status, uint32_t request_id) {
+    put_u32(resp, (uint32_t)len);
+    resp[4] = opcode;
+    resp[5] = status;
+    resp[6] = resp[7] = 0;
+    put_u32(resp + 8, request_id);
+    conn_write(conn, (const char*)resp, len);
+}
+
+static void send_status(Connection *conn, uint8_t opcode, uint8_t status, uint32_t request_id) {
+    unsigned char resp[BIN_HEADER_SZ];
+    send_frame(conn, resp, sizeof(resp), opcode, status, request_id);
+}
+
+// Reply with a single i32 body, or ERR when value < 0
+static void send_i32(Connection *conn, uint8_t opcode, uint32_t request_id, int value) {
+    if (value < 0) {
+        send_status(conn, opcode, BIN_ERR, request_id);
+        return;
+    }
+    unsigned char resp[BIN_HEADER_SZ + 4];
+    put_u32(resp + BIN_HEADER_SZ, (uint32_t)value);
+    send_frame(conn, resp, sizeof(resp), opcode, BIN_OK, request_id);
+}
+
+static int run_frame(Connection *conn, const unsigned char *frame, size_t len) {
+    uint8_t  opcode     = frame[4];
+    uint32_t request_id = (uint32_t)get_i32(frame + 8);
+    const unsigned char *body = frame + BIN_HEADER_SZ;
+    size_t body_len = len - BIN_HEADER_SZ;
+
+    switch (opcode) {
+    case BIN_OPEN: {
+        if (body_len < 50 + 20 + 10) break;
+        char name[51], nid[21], type[11];
+        get_str(name, body, 50);
+        get_str(nid,  body + 50, 20);
+        get_str(type, body + 70, 10);
+        int acct_no, pin;
+        open_account_network(name, nid, type, &acct_no, &pin);
+        if (acct_no < 0) {
+            send_status(conn, opcode, BIN_ERR, request_id);
+        } else {
+            unsigned char resp[BIN_HEADER_SZ + 8];
+            put_u32(resp + BIN_HEADER_SZ,     (uint32_t)acct_no);
+            put_u32(resp + BIN_HEADER_SZ + 4, (uint32_t)pin);
+            send_frame(conn, resp, sizeof(resp), opcode, BIN_OK, request_id);
+        }
+        return 0;
+    }
+    case BIN_DEPOSIT:
+    case BIN_WITHDRAW: {
+        if (body_len < 12) break;
+        int an = get_i32(body), p = client_pin(get_i32(body + 4)), amt = get_i32(body + 8);
+        int bal = (opcode == BIN_DEPOSIT) ? deposit_network(an, p, amt)
+                                          : withdraw_network(an, p, amt);
+        send_i32(conn, opcode, request_id, bal);
+        return 0;
+    }
+    case BIN_BATCH: {
+        if (body_len < 4) break;
+        uint32_t n = get_u32(body);
+        if (n > BIN_BATCH_MAX || body_len < 4 + n * BIN_BATCH_OP_SZ) break;
+        BatchOp ops[BIN_BATCH_MAX];
+        for (uint32_t i = 0; i < n; i++) {
+            const unsigned char *b = body + 4 + i * BIN_BATCH_OP_SZ;
+            ops[i].kind    = b[0] == BIN_DEPOSIT  ? TXN_DEPOSIT
+                           : b[0] == BIN_WITHDRAW ? TXN_WITHDRAW : 0;
+            ops[i].acct_no = get_i32(b + 1);
+            ops[i].pin     = client_pin(get_i32(b + 5));
+            ops[i].amount  = get_i32(b + 9);
+        }
+        batch_network(ops, n);
+
+        unsigned char resp[BIN_MAX_RESPONSE];
+        unsigned char *p = resp + BIN_HEADER_SZ;
+        put_u32(p, n);
+        for (uint32_t i = 0; i < n; i++) put_u32(p + 4 + i * 4, (uint32_t)ops[i].result);
+        send_frame(conn, resp, BIN_HEADER_SZ + 4 + n * 4, opcode, BIN_OK, request_id);
+        return 0;
+    }
+    case BIN_TRANSFER:
+        if (body_len < 16) break;
+        send_i32(conn, opcode, request_id,
+                 transfer_network(get_i32(body), client_pin(get_i32(body + 4)),
+                                  get_i32(body + 8), get_i32(body + 12)));
+        return 0;
+    case BIN_BALANCE:
+        if (body_len < 8) break;
+        send_i32(conn, opcode, request_id,
+                 balance_network(get_i32(body), client_pin(get_i32(body + 4))));
+        return 0;
+    case BIN_STATEMENT: {
+        if (body_len < 8) break;
+        Transaction txns[MAX_TRANS];
+        int n = statement_entries_network(get_i32(body), client_pin(get_i32(body + 4)), txns);
+        if (n < 0) {
+            send_status(conn, opcode, BIN_ERR, request_id);
+            return 0;
+        }
+        unsigned char resp[BIN_MAX_RESPONSE];
+        unsigned char *p = resp + BIN_HEADER_SZ;
+        put_u32(p, (uint32_t)n);
+        p = put_entries(p + 4, txns, n);
+        send_frame(conn, resp, p - resp, opcode, BIN_OK, request_id);
+        return 0;
+    }
+    case BIN_STATEMENT_PAGE: {
+        if (body_len < 16) break;
+        Transaction txns[STATEMENT_PAGE_MAX];
+        uint32_t total;
+        int n = statement_page_network(get_i32(body), client_pin(get_i32(body + 4)),
+                                       get_u32(body + 8), get_u32(body + 12), txns, &total);
+        if (n < 0) {
+            send_status(conn, opcode, BIN_ERR, request_id);
+            return 0;
+        }
+        unsigned char resp[BIN_MAX_RESPONSE];
+        unsigned char *p = resp + BIN_HEADER_SZ;
+        put_u32(p, total);
+        put_u32(p + 4, (uint32_t)n);
+        p = put_entries(p + 8, txns, n);
+        send_frame(conn, resp, p - resp, opcode, BIN_OK, request_id);
+        return 0;
+    }
+    case BIN_CLOSE:
+        if (body_len < 8) break;
+        send_status(conn, opcode,
+                    close_account_network(get_i32(body), client_pin(get_i32(body + 4))) == 0
+                        ? BIN_OK : BIN_ERR,
+                    request_id);
+        return 0;
+    case BIN_QUIT:
+        return 1;
+    }
+
+    // Unknown opcode or short body: the framing is intact, so just refuse it
+    send_status(conn, opcode, BIN_ERR, request_id);
+    return 0;
+}
+
+// Metrics counterpart of each opcode
+static const uint8_t opcode_command[] = {
+    [BIN_OPEN]      = CMD_OPEN,      [BIN_DEPOSIT]  = CMD_DEPOSIT,
+    [BIN_WITHDRAW]  = CMD_WITHDRAW,  [BIN_BALANCE]  = CMD_BALANCE,
+    [BIN_STATEMENT] = CMD_STATEMENT, [BIN_CLOSE]    = CMD_CLOSE,
+    [BIN_QUIT]      = CMD_QUIT,      [BIN_STATEMENT_PAGE] = CMD_STATEMENT,
+    [BIN_TRANSFER]  = CMD_TRANSFER,  [BIN_BATCH]    = CMD_BATCH,
+};
+
+int process_binary_frame(Connection *conn, const unsigned char *frame, size_t len) {
+    if (len < BIN_HEADER_SZ) return 1;   // cannot even echo a request id
+
+    uint64_t start = metrics_clock();
+    size_t before = conn_pending(conn);
+    int r = run_frame(conn, frame, len);
+    uint8_t opcode = frame[4];
+    int cmd = opcode && opcode < sizeof(opcode_command) ? opcode_command[opcode] : CMD_UNKNOWN;
+    int failed = conn_pending(conn) >= before + BIN_HEADER_SZ &&
+                 conn->out[conn->out_sent + before + 5] == BIN_ERR;
+    metrics_record(cmd, failed, start);
+    return r;
+}
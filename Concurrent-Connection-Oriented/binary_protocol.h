@@ -0,0 +1,79 @@
+/*
+ * binary_protocol.h
+ * Fixed-layout, length-prefixed binary protocol for machine-to-machine clients
+ *
+ * A connection starts in the text protocol; the client switches it by sending
+ * the line "BINARY" and, after the "OK BINARY" reply, speaks only frames.
+ * All integers are little-endian; frames are packed (no padding).
+ *
+ * Request:  u32 length | u8 opcode | u8 0 | u16 0 | u32 request_id | body
+ * Response: u32 length | u8 opcode | u8 status | u16 0 | u32 request_id | body
+ *
+ * length counts the whole frame, itself included. The response echoes the
+ * opcode and request_id; status is BIN_OK or BIN_ERR (an ERR response has no
+ * body). Responses come back in request order.
+ *
+ *   opcode          request body                       OK response body
+ *   BIN_OPEN        char name[50], nid[20], type[10]   i32 acct_no, i32 pin
+ *   BIN_DEPOSIT     i32 acct_no, i32 pin, i32 amount   i32 balance
+ *   BIN_WITHDRAW    i32 acct_no, i32 pin, i32 amount   i32 balance
+ *   BIN_BALANCE     i32 acct_no, i32 pin               i32 balance
+ *   BIN_STATEMENT   i32 acct_no, i32 pin               u32 n, n x { u8 kind, i32 amount }
+ *   BIN_CLOSE       i32 acct_no, i32 pin               (empty)
+ *   BIN_QUIT        (empty)                            (no response; connection closes)
+ *   BIN_STATEMENT_PAGE  i32 acct_no, i32 pin,          u32 total, u32 n,
+ *                   u32 offset, u32 limit              n x { u8 kind, i32 amount }
+ *   BIN_TRANSFER    i32 from, i32 pin, i32 to,         i32 balance (of from)
+ *                   i32 amount
+ *   BIN_BATCH       u32 n, n x { u8 opcode, i32 acct,  u32 n, n x i32 balance
+ *                   i32 pin, i32 amount }              (-1 where an op failed)
+ *
+ * Strings are NUL-padded; STATEMENT kind is a BinTxnKind.
+ * BIN_STATEMENT is the last MAX_TRANS entries; BIN_STATEMENT_PAGE pages through
+ * the full history (offset 0 = oldest, at most STATEMENT_PAGE_MAX per page).
+ * BIN_BATCH ops are BIN_DEPOSIT or BIN_WITHDRAW, at most BIN_BATCH_MAX per
+ * frame; each succeeds or fails on its own, as if sent separately.
+ */
+
+#ifndef BINARY_PROTOCOL_H
+#define BINARY_PROTOCOL_H
+
+#include <stddef.h>
+#include "connection.h"
+
+#define BIN_HEADER_SZ  12
+
+// BIN_BATCH: one op is 13 bytes, and a request frame is at most CONN_IN_SZ
+#define BIN_BATCH_OP_SZ  13
+#define BIN_BATCH_MAX    ((CONN_IN_SZ - BIN_HEADER_SZ - 4) / BIN_BATCH_OP_SZ)
+
+enum BinOpcode {
+    BIN_OPEN      = 1,
+    BIN_DEPOSIT   = 2,
+    BIN_WITHDRAW  = 3,
+    BIN_BALANCE   = 4,
+    BIN_STATEMENT = 5,
+    BIN_CLOSE     = 6,
+    BIN_QUIT      = 7,
+    BIN_STATEMENT_PAGE = 8,
+    BIN_TRANSFER  = 9,
+    BIN_BATCH     = 10,
+};
+
+enum BinStatus {
+    BIN_OK  = 0,
+    BIN_ERR = 1,
+};
+
+enum BinTxnKind {
+    BIN_TXN_DEPOSIT  = 1,
+    BIN_TXN_WITHDRAW = 2,
+    BIN_TXN_TRANSFER_OUT = 3,
+    BIN_TXN_TRANSFER_IN  = 4,
+};
+
+// Handle one complete frame; returns 1 when the connection should be closed
+// (QUIT, or a frame too malformed to answer).
+int process_binary_frame(Connection *conn, const unsigned char *frame, size_t len);
+
+#endif // BINARY_PROTOCOL_H
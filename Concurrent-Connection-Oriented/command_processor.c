@@ -8,71 +8,469 @@
 #include <unistd.h>
 #include "bankapp.h"
 #include "command_processor.h"
+#include "binary_protocol.h"
+#include "wal.h"
+#include "metrics.h"
+#include "log.h"
 
-static void send_line(int fd, const char *s) {
-    write(fd, s, strlen(s));
-    write(fd, "\n", 1);
+// Longest "KIND:amount\n" line: "TRANSFER_OUT:" and an 11-character int
+#define STATEMENT_LINE_MAX  32
+
+// Write "KIND:amount\n" at p; returns its length
+static size_t format_txn(char *p, const Transaction *t) {
+    const char *kind = txn_kind_name(t->kind);
+    size_t len = strlen(kind);
+    memcpy(p, kind, len);
+    p[len++] = ':';
+
+    char digits[12];
+    size_t nd = 0;
+    uint32_t v = t->amount < 0 ? -(uint32_t)t->amount : (uint32_t)t->amount;
+    if (t->amount < 0) p[len++] = '-';
+    do digits[nd++] = '0' + v % 10; while (v /= 10);
+    while (nd) p[len++] = digits[--nd];
+    p[len++] = '\n';
+    return len;
+}
+
+//
+// Format a statement reply straight into the output buffer: "OK <n>" (plus
+// " <total>" for a page) and n entry lines, in one reservation sized for the
+// worst case, so there is no intermediate heap buffer and no rescanning.
+//
+static void send_statement(Connection *conn, const Transaction *txns, int n,
+                           const uint32_t *total) {
+    size_t cap = 32 + (size_t)n * STATEMENT_LINE_MAX;
+    char *out = conn_reserve(conn, cap);
+    if (!out) return;
+    size_t len = total ? (size_t)snprintf(out, cap, "OK %d %u\n", n, *total)
+                       : (size_t)snprintf(out, cap, "OK %d\n", n);
+    for (int i = 0; i < n; i++) len += format_txn(out + len, &txns[i]);
+    conn_commit(conn, len);
+}
+
+//
+// Tokens are split in place: separators become NULs and argv points into the
+// line, so nothing is copied. Any byte up to ' ' separates words.
+//
+static int is_separator(char c) {
+    return (unsigned char)c <= ' ';
+}
+
+//
+// The registry: one entry per command, indexed by its enum Command value.
+// command_id() picks the candidate from the first letter (and the length
+// where two commands share one), then confirms it with one memcmp.
+//
+typedef struct CommandSpec {
+    const char *name;
+    size_t      len;
+    int       (*run)(Connection *conn, const Request *req);   // 1: close the connection
+} CommandSpec;
+
+static const CommandSpec registry[CMD_COUNT];
+
+static int command_id(const char *word, size_t len) {
+    int id;
+    switch (word[0]) {
+    case 'O': id = CMD_OPEN; break;
+    case 'D': id = CMD_DEPOSIT; break;
+    case 'W': id = CMD_WITHDRAW; break;
+    case 'T': id = CMD_TRANSFER; break;
+    case 'C': id = CMD_CLOSE; break;
+    case 'E': id = CMD_EXEC; break;
+    case 'Q': id = CMD_QUIT; break;
+    case 'P': id = CMD_PAGE; break;
+    case 'B': id = len == 7 ? CMD_BALANCE : len == 5 ? CMD_BATCH : CMD_BINARY; break;
+    case 'S': id = len == 9 ? CMD_STATEMENT : CMD_STATS; break;
+    case 'L': id = len == 5 ? CMD_LOGIN : CMD_LOGOUT; break;
+    default:  return CMD_UNKNOWN;
+    }
+    const CommandSpec *c = &registry[id];
+    return len == c->len && memcmp(word, c->name, len) == 0 ? id : CMD_UNKNOWN;
+}
+
+const char *command_name(int cmd) {
+    return registry[cmd].name;
+}
+
+void parse_request(char *line, Request *req) {
+    char *p = line;
+    while (*p && is_separator(*p)) p++;
+    char *word = p;
+    while (!is_separator(*p)) p++;
+    req->cmd  = command_id(word, (size_t)(p - word));
+    req->argc = 0;
+
+    while (*p) {
+        *p++ = '\0';   // ends the previous word
+        while (*p && is_separator(*p)) p++;
+        if (!*p) break;
+        if (req->argc < REQUEST_MAX_ARGS) req->argv[req->argc++] = p;
+        while (!is_separator(*p)) p++;
+    }
+}
+
+int request_uint(const Request *req, int i, unsigned *out) {
+    if (i >= req->argc) return 0;
+    const char *s = req->argv[i];
+    uint64_t v = 0;
+    do {
+        if (*s < '0' || *s > '9') return 0;
+        v = v * 10 + (*s - '0');
+        if (v > UINT32_MAX) return 0;
+    } while (*++s);
+    *out = (unsigned)v;
+    return 1;
+}
+
+int request_int(const Request *req, int i) {
+    if (i >= req->argc) return 0;
+    Request one = { .argc = 1, .argv = { req->argv[i] } };
+    int negative = req->argv[i][0] == '-';
+    if (negative || req->argv[i][0] == '+') one.argv[0]++;
+    unsigned v;
+    if (!request_uint(&one, 0, &v) || v > (unsigned)INT32_MAX + negative) return 0;
+    return negative ? (int)-(int64_t)v : (int)v;
+}
+
+// "OK <value>" without going through snprintf
+static void send_ok_int(Connection *conn, int value) {
+    char line[16] = "OK ";
+    size_t len = 3;
+    char digits[12];
+    size_t nd = 0;
+    uint32_t v = value < 0 ? -(uint32_t)value : (uint32_t)value;
+    if (value < 0) line[len++] = '-';
+    do digits[nd++] = '0' + v % 10; while (v /= 10);
+    while (nd) line[len++] = digits[--nd];
+    line[len++] = '\n';
+    conn_write(conn, line, len);
 }
 
-void process_command(int client_fd, const char *buf) {
-    char cmd[16];
-    sscanf(buf, "%15s", cmd);
+//
+// The account a command acts on: the connection's LOGIN account if it has
+// one and the command has no more than the `rest` arguments of its short
+// form (it then leaves out "<AccountNo> <PIN>"), else the first two
+// arguments, PIN checked as usual. Every short form has fewer arguments than
+// the full one, so the count alone decides. Returns the index of the first
+// remaining argument.
+//
+static int account_args(const Connection *conn, const Request *req, int rest,
+                        int *an, int *p) {
+    if (conn->auth.login && req->argc <= rest) {
+        *an = conn->auth.login_acct;
+        *p  = SESSION_PIN;
+        return 0;
+    }
+    *an = request_int(req, 0);
+    *p  = client_pin(request_int(req, 1));
+    return 2;
+}
+
+//
+// Inside BATCH: queue the line as an operation instead of running it. Lines
+// that are not DEPOSIT / WITHDRAW are queued too, as ops that will fail, so
+// results still line up with the lines sent.
+//
+static void queue_batch_op(Connection *conn, const Request *req) {
+    if (conn->batch_len >= BATCH_MAX) {
+        conn->batch_len = BATCH_MAX + 1;
+        return;
+    }
+    BatchOp *op = &conn->batch[conn->batch_len++];
+    op->kind = req->cmd == CMD_DEPOSIT  ? TXN_DEPOSIT
+             : req->cmd == CMD_WITHDRAW ? TXN_WITHDRAW : 0;
+    int rest = account_args(conn, req, 1, &op->acct_no, &op->pin);
+    op->amount = request_int(req, rest);
+}
+
+//
+// One line for the whole batch: "OK <n> <status>", with one status character
+// per op in order, '+' if it succeeded and '-' if not. Balances would not fit
+// in a line (binary BATCH returns them); BALANCE afterwards gives them.
+//
+static void send_batch_results(Connection *conn, const BatchOp *ops, int n) {
+    size_t cap = 32 + (size_t)n;
+    char *out = conn_reserve(conn, cap);
+    if (!out) return;
+    size_t len = (size_t)snprintf(out, cap, "OK %d ", n);
+    for (int i = 0; i < n; i++) out[len++] = ops[i].result >= 0 ? '+' : '-';
+    out[len++] = '\n';
+    conn_commit(conn, len);
+}
+
+// STATS: "OK <n>" and n lines of counters and gauges (metrics.h)
+static void send_stats(Connection *conn) {
+    char body[METRICS_TEXT_MAX];
+    int lines;
+    size_t len = metrics_format_stats(body, sizeof(body), &lines);
+    size_t cap = 32 + len;
+    char *out = conn_reserve(conn, cap);
+    if (!out) return;
+    size_t head = (size_t)snprintf(out, cap, "OK %d\n", lines);
+    memcpy(out + head, body, len);
+    conn_commit(conn, head + len);
+}
 
-    if (strcmp(cmd, "OPEN") == 0) {
-        char name[64], nid[32], type[16];
-        int acct_no, pin;
-        sscanf(buf + 5, "%63s %31s %15s", name, nid, type);
-        open_account_network(name, nid, type, &acct_no, &pin);
+static int cmd_open(Connection *conn, const Request *req) {
+    const char *name = req->argc > 0 ? req->argv[0] : "";
+    const char *nid  = req->argc > 1 ? req->argv[1] : "";
+    const char *type = req->argc > 2 ? req->argv[2] : "";
+    int acct_no, pin;
+    open_account_network(name, nid, type, &acct_no, &pin);
+    if (acct_no < 0) {
+        conn_send_line(conn, "ERR cannot open account");
+    } else {
         char resp[64];
         snprintf(resp, sizeof(resp), "OK %d %d", acct_no, pin);
-        send_line(client_fd, resp);
-    } else if (strcmp(cmd, "DEPOSIT") == 0) {
-        int an, p, amt;
-        sscanf(buf + 8, "%d %d %d", &an, &p, &amt);
-        int new_bal = deposit_network(an, p, amt);
-        if (new_bal >= 0) {
-            char resp[64];
-            snprintf(resp, sizeof(resp), "OK %d", new_bal);
-            send_line(client_fd, resp);
-        } else {
-            send_line(client_fd, "ERR deposit failed");
-        }
-    } else if (strcmp(cmd, "WITHDRAW") == 0) {
-        int an, p, amt;
-        sscanf(buf + 9, "%d %d %d", &an, &p, &amt);
-        int new_bal = withdraw_network(an, p, amt);
-        if (new_bal >= 0) {
-            char resp[64];
-            snprintf(resp, sizeof(resp), "OK %d", new_bal);
-            send_line(client_fd, resp);
-        } else {
-            send_line(client_fd, "ERR withdraw failed");
-        }
-    } else if (strcmp(cmd, "BALANCE") == 0) {
-        int an, p;
-        sscanf(buf + 8, "%d %d", &an, &p);
-        int bal = balance_network(an, p);
-        if (bal >= 0) {
-            char resp[64];
-            snprintf(resp, sizeof(resp), "OK %d", bal);
-            send_line(client_fd, resp);
-        } else {
-            send_line(client_fd, "ERR balance check failed");
-        }
-    } else if (strcmp(cmd, "STATEMENT") == 0) {
-        int an, p;
-        sscanf(buf + 10, "%d %d", &an, &p);
-        char *stmt = statement_network(an, p);
-        send_line(client_fd, stmt);
-        free(stmt);
-    } else if (strcmp(cmd, "CLOSE") == 0) {
-        int an, p;
-        sscanf(buf + 6, "%d %d", &an, &p);
-        if (close_account_network(an, p) == 0)
-            send_line(client_fd, "OK");
-        else
-            send_line(client_fd, "ERR close failed");
+        conn_send_line(conn, resp);
+    }
+    return 0;
+}
+
+static int cmd_deposit(Connection *conn, const Request *req) {
+    int an, p;
+    int amt = request_int(req, account_args(conn, req, 1, &an, &p));
+    int new_bal = deposit_network(an, p, amt);
+    if (new_bal >= 0) send_ok_int(conn, new_bal);
+    else conn_send_line(conn, "ERR deposit failed");
+    return 0;
+}
+
+static int cmd_withdraw(Connection *conn, const Request *req) {
+    int an, p;
+    int amt = request_int(req, account_args(conn, req, 1, &an, &p));
+    int new_bal = withdraw_network(an, p, amt);
+    if (new_bal >= 0) send_ok_int(conn, new_bal);
+    else conn_send_line(conn, "ERR withdraw failed");
+    return 0;
+}
+
+static int cmd_transfer(Connection *conn, const Request *req) {
+    int from, p;
+    int rest = account_args(conn, req, 2, &from, &p);
+    int new_bal = transfer_network(from, p, request_int(req, rest), request_int(req, rest + 1));
+    if (new_bal >= 0) send_ok_int(conn, new_bal);
+    else conn_send_line(conn, "ERR transfer failed");
+    return 0;
+}
+
+static int cmd_balance(Connection *conn, const Request *req) {
+    int an, p;
+    account_args(conn, req, 0, &an, &p);
+    int bal = balance_network(an, p);
+    if (bal >= 0) send_ok_int(conn, bal);
+    else conn_send_line(conn, "ERR balance check failed");
+    return 0;
+}
+
+// A slice of the full history: "OK <n> <total>" and n lines
+static void send_page(Connection *conn, int an, int p, unsigned offset, unsigned limit) {
+    Transaction txns[STATEMENT_PAGE_MAX];
+    uint32_t total;
+    int n = statement_page_network(an, p, offset, limit, txns, &total);
+    if (n < 0) conn_send_line(conn, "ERR cannot get statement");
+    else send_statement(conn, txns, n, &total);
+}
+
+static int cmd_statement(Connection *conn, const Request *req) {
+    int an, p;
+    unsigned offset, limit = STATEMENT_PAGE_MAX;
+    // Session forms: "STATEMENT" and "STATEMENT <offset>"; two numbers are
+    // always "<AccountNo> <PIN>"
+    int rest = account_args(conn, req, 1, &an, &p);
+    if (request_uint(req, rest, &offset)) {
+        request_uint(req, rest + 1, &limit);
+        send_page(conn, an, p, offset, limit);
     } else {
-        send_line(client_fd, "ERR unknown command");
+        // Header carries the line count so pipelining clients can frame it
+        Transaction txns[MAX_TRANS];
+        int n = statement_entries_network(an, p, txns);
+        if (n < 0) conn_send_line(conn, "ERR cannot get statement");
+        else send_statement(conn, txns, n, NULL);
+    }
+    return 0;
+}
+
+// PAGE <offset> [<limit>]: the LOGIN account's history page
+static int cmd_page(Connection *conn, const Request *req) {
+    unsigned offset, limit = STATEMENT_PAGE_MAX;
+    if (!conn->auth.login || !request_uint(req, 0, &offset)) {
+        conn_send_line(conn, "ERR cannot get statement");
+        return 0;
+    }
+    request_uint(req, 1, &limit);
+    send_page(conn, conn->auth.login_acct, SESSION_PIN, offset, limit);
+    return 0;
+}
+
+static int cmd_close(Connection *conn, const Request *req) {
+    int an, p;
+    account_args(conn, req, 0, &an, &p);
+    if (close_account_network(an, p) == 0)
+        conn_send_line(conn, "OK");
+    else
+        conn_send_line(conn, "ERR close failed");
+    return 0;
+}
+
+static int cmd_login(Connection *conn, const Request *req) {
+    // Later commands act on this account without naming it; a failed
+    // LOGIN leaves the connection logged out
+    int an = request_int(req, 0);
+    uint32_t generation = 0;
+    conn->auth.login = login_network(an, client_pin(request_int(req, 1)), &generation);
+    conn->auth.login_acct = an;
+    conn->auth.login_generation = generation;
+    conn_send_line(conn, conn->auth.login ? "OK" : "ERR login failed");
+    return 0;
+}
+
+static int cmd_logout(Connection *conn, const Request *req) {
+    (void)req;
+    conn->auth.login = NULL;
+    conn_send_line(conn, "OK");
+    return 0;
+}
+
+static int cmd_batch(Connection *conn, const Request *req) {
+    (void)req;
+    // No reply: the ops that follow are answered together by EXEC
+    conn->batch = malloc(BATCH_MAX * sizeof(BatchOp));
+    conn->batch_len = 0;
+    return conn->batch ? 0 : 1;   // without it the reply stream cannot stay in step
+}
+
+static int cmd_exec(Connection *conn, const Request *req) {
+    (void)req;
+    if (!conn->batch) {
+        conn_send_line(conn, "ERR no batch");
+        return 0;
+    }
+    if (conn->batch_len > BATCH_MAX) {
+        conn_send_line(conn, "ERR batch too large");
+    } else {
+        batch_network(conn->batch, conn->batch_len);
+        send_batch_results(conn, conn->batch, conn->batch_len);
+    }
+    free(conn->batch);
+    conn->batch = NULL;
+    return 0;
+}
+
+static int cmd_binary(Connection *conn, const Request *req) {
+    (void)req;
+    // Everything after this line is binary frames (binary_protocol.h)
+    conn->binary = 1;
+    conn_send_line(conn, "OK BINARY");
+    return 0;
+}
+
+static int cmd_stats(Connection *conn, const Request *req) {
+    (void)req;
+    send_stats(conn);
+    return 0;
+}
+
+static int cmd_quit(Connection *conn, const Request *req) {
+    (void)conn;
+    (void)req;
+    return 1;
+}
+
+static int cmd_unknown(Connection *conn, const Request *req) {
+    (void)req;
+    conn_send_line(conn, "ERR unknown command");
+    return 0;
+}
+
+static const CommandSpec registry[CMD_COUNT] = {
+    [CMD_OPEN]      = { "OPEN",      4, cmd_open },
+    [CMD_DEPOSIT]   = { "DEPOSIT",   7, cmd_deposit },
+    [CMD_WITHDRAW]  = { "WITHDRAW",  8, cmd_withdraw },
+    [CMD_TRANSFER]  = { "TRANSFER",  8, cmd_transfer },
+    [CMD_BALANCE]   = { "BALANCE",   7, cmd_balance },
+    [CMD_STATEMENT] = { "STATEMENT", 9, cmd_statement },
+    [CMD_PAGE]      = { "PAGE",      4, cmd_page },
+    [CMD_CLOSE]     = { "CLOSE",     5, cmd_close },
+    [CMD_LOGIN]     = { "LOGIN",     5, cmd_login },
+    [CMD_LOGOUT]    = { "LOGOUT",    6, cmd_logout },
+    [CMD_BATCH]     = { "BATCH",     5, cmd_batch },
+    [CMD_EXEC]      = { "EXEC",      4, cmd_exec },
+    [CMD_BINARY]    = { "BINARY",    6, cmd_binary },
+    [CMD_STATS]     = { "STATS",     5, cmd_stats },
+    [CMD_QUIT]      = { "QUIT",      4, cmd_quit },
+    [CMD_UNKNOWN]   = { "UNKNOWN",   7, cmd_unknown },
+};
+
+int process_command(Connection *conn, char *line) {
+    Request req;
+    parse_request(line, &req);
+
+    if (conn->batch && req.cmd != CMD_EXEC && req.cmd != CMD_QUIT) {
+        queue_batch_op(conn, &req);
+        return 0;
+    }
+
+    // Every error reply starts with "ERR"; queued output may move, so
+    // remember where the reply starts relative to the unsent part
+    uint64_t start = metrics_clock();
+    size_t before = conn_pending(conn);
+    int r = registry[req.cmd].run(conn, &req);
+    int failed = conn_pending(conn) > before && conn->out[conn->out_sent + before] == 'E';
+    metrics_record(req.cmd, failed, start);
+    return r;
+}
+
+static int dispatch_one(Connection *conn) {
+    if (conn->binary) {
+        unsigned char *frame;
+        size_t len;
+        int r = conn_next_frame(conn, &frame, &len);
+        if (r == CONN_NEED_MORE) return DISPATCH_NEED_MORE;
+        if (r == CONN_BAD_FRAME) return DISPATCH_CLOSE;
+        return process_binary_frame(conn, frame, len) ? DISPATCH_CLOSE : DISPATCH_DONE;
+    }
+
+    char *line;
+    int r = conn_next_line(conn, &line);
+    if (r == CONN_NEED_MORE) return DISPATCH_NEED_MORE;
+    if (r == CONN_TOO_LONG) {
+        conn_send_line(conn, "ERR line too long");
+        return DISPATCH_DONE;
+    }
+    return process_command(conn, line) ? DISPATCH_CLOSE : DISPATCH_DONE;
+}
+
+int dispatch_input(Connection *conn) {
+    auth_bind_session(&conn->auth);
+    int r = dispatch_one(conn);
+    auth_bind_session(NULL);
+    // Replies leave in order, so the buffer waits for its latest dependency
+    uint64_t lsn = wal_take_dependency();
+    if (lsn > conn->commit_lsn) conn->commit_lsn = lsn;
+    return r;
+}
+
+int commit_and_flush(Connection *conn) {
+    wal_wait_durable(conn->commit_lsn);
+    return conn_flush(conn);
+}
+
+void serve_connection(Connection *conn) {
+    while (1) {
+        int r = dispatch_input(conn);
+        if (r == DISPATCH_CLOSE) break;
+        if (r == DISPATCH_NEED_MORE) {
+            // Input batch exhausted: send its replies, then read more
+            if (commit_and_flush(conn) < 0) return;
+            log_flush();
+            if (conn_fill(conn) <= 0) return;
+            continue;
+        }
+        // A long pipelined burst still cannot grow the buffer without bound
+        if (conn_pending(conn) > CONN_OUT_HIGH && commit_and_flush(conn) < 0) return;
     }
+    commit_and_flush(conn);
 }
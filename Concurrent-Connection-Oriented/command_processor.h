@@ -5,7 +5,78 @@
 #ifndef CMD_PROC_H
 #define CMD_PROC_H
 
-void process_command(int client_fd, const char *buf);
+#include "connection.h"
+
+// Every command, text or binary; also the index into the registry and into
+// the per-command metrics
+enum Command {
+    CMD_OPEN,
+    CMD_DEPOSIT,
+    CMD_WITHDRAW,
+    CMD_TRANSFER,
+    CMD_BALANCE,
+    CMD_STATEMENT,
+    CMD_PAGE,
+    CMD_CLOSE,
+    CMD_LOGIN,
+    CMD_LOGOUT,
+    CMD_BATCH,
+    CMD_EXEC,
+    CMD_BINARY,
+    CMD_STATS,
+    CMD_QUIT,
+    CMD_UNKNOWN,
+    CMD_COUNT
+};
+
+#define REQUEST_MAX_ARGS  6   // further words are ignored
+
+// A command line split in place: argv points into the line
+typedef struct Request {
+    int   cmd;                // enum Command
+    int   argc;
+    char *argv[REQUEST_MAX_ARGS];
+} Request;
+
+// Split `line` into words (overwriting separators) and look up the first
+// one. Nothing is copied and nothing is allocated.
+void parse_request(char *line, Request *req);
+
+// Argument i as an int; 0 if it is missing or not wholly a number in range
+int  request_int(const Request *req, int i);
+
+// Argument i as an unsigned into *out; 0 (and *out untouched) if it is
+// missing or not wholly a number in range
+int  request_uint(const Request *req, int i, unsigned *out);
+
+// "DEPOSIT" for CMD_DEPOSIT, and so on
+const char *command_name(int cmd);
+
+// Handle one command line and queue its reply on the connection. Replies are
+// sent in request order, one per command; STATEMENT, PAGE and STATS reply
+// "OK <n>" followed by n lines. Each command is counted and timed (metrics.h). The
+// line is tokenized in place. Returns 1 when the client sent QUIT and the
+// connection should be closed.
+int process_command(Connection *conn, char *line);
+
+// dispatch_input() results
+#define DISPATCH_NEED_MORE  0   // no complete request buffered
+#define DISPATCH_DONE       1   // one request handled, its reply queued
+#define DISPATCH_CLOSE      2   // QUIT, or a binary stream that lost sync
+
+// Handle the next buffered request in whichever protocol the connection
+// speaks (text lines, or binary frames after "BINARY"). Raises
+// conn->commit_lsn to whatever the reply depends on in the write-ahead log.
+int dispatch_input(Connection *conn);
+
+// Wait until the WAL covers conn->commit_lsn, then conn_flush(). Concurrent
+// callers share one fdatasync (group commit).
+int commit_and_flush(Connection *conn);
+
+// Blocking-socket service loop used by the process and thread servers: frames
+// lines, dispatches them and flushes all replies of each input batch with one
+// write(). Returns when the client quits or the connection drops.
+void serve_connection(Connection *conn);
 
 #endif // CMD_PROC_H
 
@@ -0,0 +1,204 @@
+/*
+ * connection.c
+ * Buffered line framing for the text protocol.
+ *
+ * TCP is a byte stream: one read() may return half a command, or several
+ * pipelined commands at once. conn_fill() pulls whatever the socket has in one
+ * large read, and conn_next_line() hands out complete lines in place
+ * (NUL-terminated, trailing '\r' stripped) until only a partial line is left.
+ *
+ * Output goes the other way: replies are appended to a per-connection buffer
+ * and conn_flush() sends everything one input batch produced with a single
+ * write(). On a non-blocking socket a short write just leaves the rest queued;
+ * callers check conn_pending() against CONN_OUT_HIGH to apply backpressure.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include "connection.h"
+
+void conn_init(Connection *c, int fd) {
+    c->fd         = fd;
+    c->in_start   = 0;
+    c->in_end     = 0;
+    c->scanned    = 0;
+    c->discarding = 0;
+    c->binary     = 0;
+    c->out        = NULL;
+    c->out_len    = 0;
+    c->out_cap    = 0;
+    c->out_sent   = 0;
+    c->out_error  = 0;
+    c->closing    = 0;
+    c->commit_lsn = 0;
+    c->batch      = NULL;
+    c->batch_len  = 0;
+    c->auth.used  = 0;
+    c->auth.next  = 0;
+    c->auth.login = NULL;
+
+    // Replies leave in one write per batch, so Nagle can only add latency
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+void conn_destroy(Connection *c) {
+    free(c->batch);
+    c->batch = NULL;
+    free(c->out);
+    c->out     = NULL;
+    c->out_cap = c->out_len = c->out_sent = 0;
+}
+
+//
+// Read as much as fits into the free tail of the buffer, first sliding any
+// partial line to the front. Returns bytes read, 0 on EOF, or -1 with errno
+// set (EAGAIN/EWOULDBLOCK on an idle non-blocking socket).
+//
+ssize_t conn_fill(Connection *c) {
+    if (c->in_start > 0) {
+        memmove(c->in, c->in + c->in_start, c->in_end - c->in_start);
+        c->in_end  -= c->in_start;
+        c->in_start = 0;
+    }
+    // conn_next_line() never leaves a full buffer behind
+    ssize_t n;
+    do {
+        n = read(c->fd, c->in + c->in_end, CONN_IN_SZ - c->in_end);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) c->in_end += n;
+    return n;
+}
+
+//
+// Frame the next complete line. Returns CONN_LINE with *line pointing into the
+// buffer (valid until the next conn_fill()), CONN_NEED_MORE when only a
+// partial line is buffered, or CONN_TOO_LONG once for each line that did not
+// fit in CONN_IN_SZ bytes (its bytes are dropped).
+//
+int conn_next_line(Connection *c, char **line) {
+    while (1) {
+        char *start = c->in + c->in_start;
+        size_t avail = c->in_end - c->in_start;
+        char *nl = memchr(start + c->scanned, '\n', avail - c->scanned);
+
+        if (!nl) {
+            c->scanned = avail;
+            if (avail < CONN_IN_SZ) return CONN_NEED_MORE;
+            // A full buffer with no newline can never become a valid line
+            c->in_start = c->in_end = c->scanned = 0;
+            if (c->discarding) return CONN_NEED_MORE;
+            c->discarding = 1;
+            return CONN_TOO_LONG;
+        }
+
+        *nl = '\0';
+        c->in_start += (nl - start) + 1;
+        c->scanned   = 0;
+        if (c->discarding) {
+            // Tail of an over-long line: already reported, skip it
+            c->discarding = 0;
+            continue;
+        }
+        if (nl > start && nl[-1] == '\r') nl[-1] = '\0';
+        *line = start;
+        return CONN_LINE;
+    }
+}
+
+//
+// Binary mode framing: every frame starts with its total length as a
+// little-endian uint32 (the length field included). Returns CONN_FRAME with
+// *frame/*len describing one complete frame in place, CONN_NEED_MORE, or
+// CONN_BAD_FRAME if the length is impossible (the stream cannot be resynced).
+//
+int conn_next_frame(Connection *c, unsigned char **frame, size_t *len) {
+    size_t avail = c->in_end - c->in_start;
+    if (avail < 4) return CONN_NEED_MORE;
+
+    uint32_t flen;
+    memcpy(&flen, c->in + c->in_start, 4);
+    flen = le32toh(flen);
+    if (flen < 4 || flen > CONN_IN_SZ) return CONN_BAD_FRAME;
+    if (avail < flen) return CONN_NEED_MORE;
+
+    *frame = (unsigned char*)c->in + c->in_start;
+    *len   = flen;
+    c->in_start += flen;
+    return CONN_FRAME;
+}
+
+//
+// Make room for `len` more bytes at the end of the output buffer and return
+// where they go (NULL after a failed append); conn_commit() then queues the
+// bytes actually written there. The buffer grows as needed; its already-sent
+// prefix is reclaimed before growing.
+//
+char *conn_reserve(Connection *c, size_t len) {
+    if (c->out_error) return NULL;
+    if (c->out_sent > 0 && c->out_len + len > c->out_cap) {
+        memmove(c->out, c->out + c->out_sent, c->out_len - c->out_sent);
+        c->out_len -= c->out_sent;
+        c->out_sent = 0;
+    }
+    if (c->out_len + len > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : CONN_OUT_INIT;
+        while (cap < c->out_len + len) cap *= 2;
+        char *grown = realloc(c->out, cap);
+        if (!grown) {
+            c->out_error = 1;
+            return NULL;
+        }
+        c->out     = grown;
+        c->out_cap = cap;
+    }
+    return c->out + c->out_len;
+}
+
+void conn_commit(Connection *c, size_t len) {
+    c->out_len += len;
+}
+
+// Queue bytes for the next conn_flush()
+void conn_write(Connection *c, const char *data, size_t len) {
+    char *dst = conn_reserve(c, len);
+    if (!dst) return;
+    memcpy(dst, data, len);
+    conn_commit(c, len);
+}
+
+void conn_send_line(Connection *c, const char *s) {
+    conn_write(c, s, strlen(s));
+    conn_write(c, "\n", 1);
+}
+
+size_t conn_pending(const Connection *c) {
+    return c->out_len - c->out_sent;
+}
+
+//
+// Write queued output. Returns 0 once everything is sent, 1 if a non-blocking
+// socket stopped accepting data (the rest stays queued; wait for EPOLLOUT),
+// or -1 on a socket error or an earlier failed append.
+//
+int conn_flush(Connection *c) {
+    if (c->out_error) return -1;
+    while (c->out_sent < c->out_len) {
+        ssize_t n = write(c->fd, c->out + c->out_sent, c->out_len - c->out_sent);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            return -1;
+        }
+        c->out_sent += n;
+    }
+    c->out_len = c->out_sent = 0;
+    return 0;
+}
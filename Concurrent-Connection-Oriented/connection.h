@@ -0,0 +1,63 @@
+/*
+ * connection.h
+ * Per-connection input buffering / newline framing and output gathering,
+ * shared by all servers
+ */
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "auth.h"
+
+#define CONN_IN_SZ     4096    // read chunk, and the longest accepted command line
+#define CONN_OUT_INIT  4096    // initial output buffer
+#define CONN_OUT_HIGH  65536   // stop taking new commands above this much unsent output
+
+typedef struct Connection {
+    int    fd;
+    char   in[CONN_IN_SZ];
+    size_t in_start;        // first byte not yet handed out as a line
+    size_t in_end;          // one past the last byte read
+    size_t scanned;         // bytes after in_start already known to hold no '\n'
+    int    discarding;      // dropping the rest of an over-long line
+    int    binary;          // client negotiated length-prefixed binary frames
+
+    char  *out;             // replies gathered for the next flush
+    size_t out_len;
+    size_t out_cap;
+    size_t out_sent;        // prefix of out already written to the socket
+    int    out_error;       // an append failed; the connection is unusable
+    int    closing;         // close once everything has been flushed
+    uint64_t commit_lsn;    // replies in out may not leave before the WAL is durable here
+
+    struct BatchOp *batch;  // text BATCH being collected until EXEC, else NULL
+    int    batch_len;       // ops queued; BATCH_MAX + 1 once it overflowed
+    AuthCache auth;         // accounts this client has proven a PIN for
+} Connection;
+
+// conn_next_line() results
+#define CONN_NEED_MORE   0
+#define CONN_LINE        1
+#define CONN_TOO_LONG   -1
+
+// conn_next_frame() results (binary mode)
+#define CONN_FRAME       2
+#define CONN_BAD_FRAME  -2
+
+void    conn_init(Connection *c, int fd);
+void    conn_destroy(Connection *c);
+ssize_t conn_fill(Connection *c);
+int     conn_next_line(Connection *c, char **line);
+int     conn_next_frame(Connection *c, unsigned char **frame, size_t *len);
+
+char   *conn_reserve(Connection *c, size_t len);
+void    conn_commit(Connection *c, size_t len);
+void    conn_write(Connection *c, const char *data, size_t len);
+void    conn_send_line(Connection *c, const char *s);
+size_t  conn_pending(const Connection *c);
+int     conn_flush(Connection *c);
+
+#endif // CONNECTION_H
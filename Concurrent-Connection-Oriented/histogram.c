@@ -0,0 +1,63 @@
+/*
+ * histogram.c
+ * Log-linear histogram: index i < 2^HIST_SUB_BITS holds the value i; above
+ * that, i = shift * HIST_HALF + (v >> shift), where shift keeps the top
+ * HIST_SUB_BITS bits of v.
+ */
+
+#include <string.h>
+#include "histogram.h"
+
+void hist_reset(Histogram *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+unsigned hist_index(uint64_t v) {
+    if (v >= (1ull << HIST_MAX_BITS)) v = (1ull << HIST_MAX_BITS) - 1;
+    if (v < 2 * HIST_HALF) return (unsigned)v;
+    unsigned shift = 63 - __builtin_clzll(v) - (HIST_SUB_BITS - 1);
+    return shift * HIST_HALF + (unsigned)(v >> shift);
+}
+
+// Largest value that lands in bucket `index`
+uint64_t hist_bucket_high(unsigned index) {
+    if (index < 2 * HIST_HALF) return index;
+    unsigned shift = index / HIST_HALF - 1;
+    uint64_t m = index - shift * HIST_HALF;
+    return ((m + 1) << shift) - 1;
+}
+
+void hist_record(Histogram *h, uint64_t value) {
+    h->buckets[hist_index(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max) h->max = value;
+}
+
+void hist_merge(Histogram *into, const Histogram *from) {
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) into->buckets[i] += from->buckets[i];
+    into->count += from->count;
+    into->sum   += from->sum;
+    if (from->max > into->max) into->max = from->max;
+}
+
+//
+// Smallest value that at least `percent` of the recorded values do not
+// exceed, to bucket precision (never above the true maximum); 0 if empty.
+//
+uint64_t hist_percentile(const Histogram *h, double percent) {
+    if (h->count == 0) return 0;
+    uint64_t want = (uint64_t)(h->count * percent / 100.0 + 0.999999);
+    if (want < 1) want = 1;
+    if (want > h->count) want = h->count;
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want) {
+            uint64_t high = hist_bucket_high(i);
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
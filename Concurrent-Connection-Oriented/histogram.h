@@ -0,0 +1,38 @@
+/*
+ * histogram.h
+ * Log-linear latency histogram in the style of HdrHistogram
+ *
+ * Values below 2^HIST_SUB_BITS are counted exactly; above that every power
+ * of two is split into 2^(HIST_SUB_BITS-1) equal buckets, so a recorded
+ * value is known to within 1/2^(HIST_SUB_BITS-1) (under 1%) whatever its
+ * magnitude. Recording is an index computation and an increment; merging is
+ * adding arrays, so per-thread histograms combine exactly.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS  8
+#define HIST_MAX_BITS  40     // values from 2^40 (ns: ~18 minutes) are clamped
+#define HIST_HALF      (1u << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS   ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_HALF)
+
+typedef struct Histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} Histogram;
+
+void     hist_reset(Histogram *h);
+void     hist_record(Histogram *h, uint64_t value);
+void     hist_merge(Histogram *into, const Histogram *from);
+uint64_t hist_percentile(const Histogram *h, double percent);
+
+// Bucket layout, for exporters that walk the buckets themselves
+unsigned hist_index(uint64_t value);
+uint64_t hist_bucket_high(unsigned index);
+
+#endif // HISTOGRAM_H
@@ -0,0 +1,90 @@
+/*
+ * history.c
+ * Full transaction history of an account, for audits and paged statements.
+ *
+ * Entries go into a singly linked list of fixed-size chunks carved from the
+ * ledger's history slab: appending is O(1) (fill the tail chunk, or link a
+ * new one), nothing is ever moved, and the hot Account record is not touched.
+ * Reading a page walks offset / HISTORY_CHUNK links and then copies only the
+ * entries asked for. Callers hold the account's stripe lock.
+ */
+
+#include <string.h>
+#include "history.h"
+#include "ledger.h"
+
+const char *txn_kind_name(int kind) {
+    switch (kind) {
+    case TXN_DEPOSIT:      return "DEPOSIT";
+    case TXN_TRANSFER_OUT: return "TRANSFER_OUT";
+    case TXN_TRANSFER_IN:  return "TRANSFER_IN";
+    default:               return "WITHDRAW";
+    }
+}
+
+//
+// Make sure the next history_append() cannot fail: if it will need a new
+// chunk, allocate it now. Returns 0, or -1 if no chunk could be allocated
+// (the shared ledger's fixed history pool is exhausted).
+//
+int history_reserve(History *h) {
+    if (h->count % HISTORY_CHUNK != 0 || h->spare) return 0;
+    h->spare = ledger_alloc_history_chunk();
+    return h->spare ? 0 : -1;
+}
+
+//
+// Append one entry. Returns 0, or -1 if no chunk could be allocated; the
+// entry is then lost, which history_reserve() beforehand rules out.
+//
+int history_append(History *h, Transaction t) {
+    uint32_t slot = h->count % HISTORY_CHUNK;
+    if (slot == 0) {
+        HistoryChunk *c = h->spare ? h->spare : ledger_alloc_history_chunk();
+        if (!c) return -1;
+        h->spare = NULL;
+        c->next = NULL;
+        if (h->tail) h->tail->next = c;
+        else h->head = c;
+        h->tail = c;
+    }
+    h->tail->entries[slot] = t;
+    h->count++;
+    return 0;
+}
+
+//
+// Copy up to `limit` entries starting at `offset` (0 = oldest) into out[].
+// Returns the number copied.
+//
+size_t history_read(const History *h, uint32_t offset, uint32_t limit, Transaction *out) {
+    if (offset >= h->count) return 0;
+    if (limit > h->count - offset) limit = h->count - offset;
+
+    const HistoryChunk *c = h->head;
+    for (uint32_t skip = offset / HISTORY_CHUNK; skip > 0; skip--) c = c->next;
+
+    uint32_t slot = offset % HISTORY_CHUNK;
+    size_t n = 0;
+    while (n < limit) {
+        size_t take = HISTORY_CHUNK - slot;
+        if (take > limit - n) take = limit - n;
+        memcpy(out + n, c->entries + slot, take * sizeof(Transaction));
+        n += take;
+        slot = 0;
+        c = c->next;
+    }
+    return n;
+}
+
+void history_release(History *h) {
+    HistoryChunk *c = h->head;
+    while (c) {
+        HistoryChunk *next = c->next;
+        ledger_free_history_chunk(c);
+        c = next;
+    }
+    if (h->spare) ledger_free_history_chunk(h->spare);
+    h->head = h->tail = h->spare = NULL;
+    h->count = 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * history.h
+ * Per-account, append-only transaction history in fixed-size chunks
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum TxnKind {
+    TXN_DEPOSIT  = 1,
+    TXN_WITHDRAW = 2,
+    TXN_TRANSFER_OUT = 3,
+    TXN_TRANSFER_IN  = 4,
+};
+
+typedef struct Transaction {
+    int32_t amount;
+    uint8_t kind;     // TxnKind
+} Transaction;
+
+#define HISTORY_CHUNK  31   // entries per chunk: 256-byte chunks
+
+typedef struct HistoryChunk {
+    struct HistoryChunk *next;
+    Transaction          entries[HISTORY_CHUNK];
+} HistoryChunk;
+
+// Oldest chunk first; only the tail chunk is ever partly filled
+typedef struct History {
+    HistoryChunk *head;
+    HistoryChunk *tail;
+    HistoryChunk *spare;     // allocated by history_reserve(), not yet linked
+    uint32_t      count;     // entries stored, oldest = 0
+} History;
+
+const char *txn_kind_name(int kind);
+
+int    history_reserve(History *h);
+int    history_append(History *h, Transaction t);
+size_t history_read(const History *h, uint32_t offset, uint32_t limit, Transaction *out);
+void   history_release(History *h);
+
+#endif // HISTORY_H
@@ -0,0 +1,309 @@
+/*
+ * ledger.c
+ * Where the account table lives, and how concurrent access to it is ordered.
+ *
+ * By default the ledger is an ordinary process-private structure, with
+ * Account records carved from slab chunks (slab.c) rather than malloc'd one
+ * by one. ledger_init_shared() instead builds it inside one MAP_SHARED
+ * anonymous mapping: header, index slots and fixed slabs of Account,
+ * AccountDetails and history records. The mapping is created before
+ * bank_server starts forking, so every child sees it at the same address and
+ * raw pointers stay valid across processes.
+ *
+ * Locking: requests on one account take only that account's stripe, so
+ * unrelated accounts proceed in parallel on different cores. OPEN and CLOSE
+ * change the index, which any locked lookup may be probing, so they take all
+ * stripes in ascending order. Not every Account* is held under a stripe:
+ * BALANCE and STATEMENT read without one, and a LOGIN session keeps its
+ * record between requests. CLOSE can still free the record as soon as it
+ * owns all stripes, because slabs are never unmapped (a stale pointer reads
+ * harmless memory), lock-free readers revalidate through index_seq and the
+ * record's version (ledger.h) and throw away what they read if either moved,
+ * and a session revalidates through the record's generation, which CLOSE
+ * bumps and reuse keeps.
+ *
+ * Durability: with a write-ahead log (wal.c) the table is rebuilt at startup,
+ * before any client is accepted, from the latest snapshot (snapshot.c) plus
+ * the log written after it.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "ledger.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "log.h"
+
+static Ledger private_ledger = {
+    .stripes             = { [0 ... LEDGER_STRIPES - 1] = { PTHREAD_MUTEX_INITIALIZER } },
+    .shared              = 0,
+    .account_number_seed = 1001,
+    .pool_lock           = PTHREAD_MUTEX_INITIALIZER,
+    .accounts            = { .obj_size = sizeof(Account), .chunk_objs = LEDGER_SLAB_CHUNK },
+    .details             = { .obj_size = sizeof(AccountDetails), .chunk_objs = LEDGER_SLAB_CHUNK },
+    .history             = { .obj_size = sizeof(HistoryChunk), .chunk_objs = LEDGER_SLAB_CHUNK },
+};
+
+Ledger *ledger = &private_ledger;
+
+static int init_shared_mutex(pthread_mutex_t *m) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    // A child that dies mid-request must not wedge every other child
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int rc = pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return rc;
+}
+
+//
+// Map header + index + record pool as one shared region. Returns 0 on
+// success, -1 (errno set) if the mapping or mutex setup fails.
+//
+int ledger_init_shared(size_t capacity) {
+    size_t slots     = index_slots_for(capacity);
+    size_t index_off = (sizeof(Ledger) + 63) & ~(size_t)63;
+    size_t pool_off  = index_off + slots * sizeof(IndexSlot);
+    size_t cold_off  = pool_off + capacity * sizeof(Account);
+    size_t hist_off  = cold_off + capacity * sizeof(AccountDetails);
+    size_t chunks    = capacity * LEDGER_HISTORY_CHUNKS_PER_ACCOUNT;
+    size_t total     = hist_off + chunks * sizeof(HistoryChunk);
+
+    // MAP_NORESERVE: pages are only backed once accounts actually land there
+    char *base = mmap(NULL, total, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) return -1;
+
+    Ledger *l = (Ledger*)base;
+    int rc = init_shared_mutex(&l->pool_lock);
+    for (int i = 0; i < LEDGER_STRIPES && rc == 0; i++)
+        rc = init_shared_mutex(&l->stripes[i].lock);
+    if (rc != 0) {
+        munmap(base, total);
+        errno = rc;
+        return -1;
+    }
+
+    l->shared = 1;
+    atomic_init(&l->account_number_seed, atomic_load(&ledger->account_number_seed));
+    index_init_fixed(&l->index, (IndexSlot*)(base + index_off), slots);
+    slab_init_fixed(&l->accounts, sizeof(Account), base + pool_off, capacity);
+    slab_init_fixed(&l->details, sizeof(AccountDetails), base + cold_off, capacity);
+    slab_init_fixed(&l->history, sizeof(HistoryChunk), base + hist_off, chunks);
+
+    ledger = l;
+    return 0;
+}
+
+static void lock_robust(pthread_mutex_t *m) {
+    if (pthread_mutex_lock(m) == EOWNERDEAD) {
+        // Previous owner crashed; the table itself is still usable
+        LOG_WARN("ledger: recovered lock from a dead process");
+        pthread_mutex_consistent(m);
+    }
+}
+
+//
+// Allocate one zeroed account: a hot record and its AccountDetails, each
+// from its own slab. NULL when out of memory or, in shared mode, when the
+// fixed pool is exhausted.
+//
+Account *ledger_alloc_account(void) {
+    lock_robust(&ledger->pool_lock);
+    Account *acc = slab_alloc(&ledger->accounts);
+    AccountDetails *d = acc ? slab_alloc(&ledger->details) : NULL;
+    if (acc && !d) {
+        slab_free(&ledger->accounts, acc);
+        acc = NULL;
+    }
+    pthread_mutex_unlock(&ledger->pool_lock);
+    if (!acc) return NULL;
+
+    // A stale LOGIN may still be comparing this record's generation (the
+    // slab's free-list link only overwrote the first word), so clear
+    // everything but that
+    size_t gen_end = offsetof(Account, generation) + sizeof(acc->generation);
+    memset(acc, 0, offsetof(Account, generation));
+    memset((char*)acc + gen_end, 0, sizeof(Account) - gen_end);
+    memset(d, 0, sizeof(AccountDetails));
+    acc->details = d;
+    return acc;
+}
+
+void ledger_free_account(Account *acc) {
+    history_release(&acc->details->history);
+    lock_robust(&ledger->pool_lock);
+    slab_free(&ledger->details, acc->details);
+    slab_free(&ledger->accounts, acc);
+    pthread_mutex_unlock(&ledger->pool_lock);
+}
+
+HistoryChunk *ledger_alloc_history_chunk(void) {
+    lock_robust(&ledger->pool_lock);
+    HistoryChunk *c = slab_alloc(&ledger->history);
+    pthread_mutex_unlock(&ledger->pool_lock);
+    return c;
+}
+
+void ledger_free_history_chunk(HistoryChunk *c) {
+    lock_robust(&ledger->pool_lock);
+    slab_free(&ledger->history, c);
+    pthread_mutex_unlock(&ledger->pool_lock);
+}
+
+void ledger_alloc_stats(SlabStats *out) {
+    lock_robust(&ledger->pool_lock);
+    *out = ledger->accounts.stats;
+    pthread_mutex_unlock(&ledger->pool_lock);
+}
+
+long ledger_account_count(void) {
+    SlabStats stats;
+    ledger_alloc_stats(&stats);
+    return (long)stats.live;
+}
+
+static pthread_mutex_t *stripe_of(int acct_no) {
+    return &ledger->stripes[ledger_stripe(acct_no)].lock;
+}
+
+void ledger_lock_account(int acct_no) {
+    lock_robust(stripe_of(acct_no));
+}
+
+void ledger_unlock_account(int acct_no) {
+    pthread_mutex_unlock(stripe_of(acct_no));
+}
+
+//
+// Both accounts' stripes, lower stripe first (once if they share one). Any
+// two requests then take stripes in the same global order, so transfers
+// cannot deadlock against each other or against lock_all.
+//
+void ledger_lock_pair(int acct_a, int acct_b) {
+    pthread_mutex_t *a = stripe_of(acct_a), *b = stripe_of(acct_b);
+    if (a > b) {
+        pthread_mutex_t *t = a;
+        a = b;
+        b = t;
+    }
+    lock_robust(a);
+    if (b != a) lock_robust(b);
+}
+
+void ledger_unlock_pair(int acct_a, int acct_b) {
+    pthread_mutex_t *a = stripe_of(acct_a), *b = stripe_of(acct_b);
+    if (b != a) pthread_mutex_unlock(b);
+    pthread_mutex_unlock(a);
+}
+
+// Always ascending, so lock_all never deadlocks against another lock_all
+void ledger_lock_all(void) {
+    for (int i = 0; i < LEDGER_STRIPES; i++)
+        lock_robust(&ledger->stripes[i].lock);
+    seq_write_begin(&ledger->index_seq);
+}
+
+void ledger_unlock_all(void) {
+    seq_write_end(&ledger->index_seq);
+    for (int i = LEDGER_STRIPES - 1; i >= 0; i--)
+        pthread_mutex_unlock(&ledger->stripes[i].lock);
+}
+
+//
+// Re-apply one logged change. Runs single-threaded before the server
+// accepts anyone, so no stripe locks; records were validated when logged.
+// Changes the snapshot already holds (lsn <= the account's last_lsn) are
+// skipped, which makes replaying from a fuzzy snapshot's position exact.
+//
+static void replay_record(const WalRecord *rec, uint64_t lsn) {
+    Account *acc = index_lookup(&ledger->index, rec->acct_no);
+    if (rec->type == WAL_TRANSFER) {
+        // Two accounts, each skipped on its own: a fuzzy snapshot may have
+        // caught one side of the transfer and not the other
+        Account *to = index_lookup(&ledger->index, rec->to_acct);
+        if (acc && lsn > acc->last_lsn) {
+            acc->balance -= rec->value;
+            record_transaction(acc, TXN_TRANSFER_OUT, rec->value);
+            acc->last_lsn = lsn;
+        }
+        if (to && lsn > to->last_lsn) {
+            to->balance += rec->value;
+            record_transaction(to, TXN_TRANSFER_IN, rec->value);
+            to->last_lsn = lsn;
+        }
+        return;
+    }
+    if (acc && lsn <= acc->last_lsn) return;
+
+    switch (rec->type) {
+    case WAL_OPEN:
+    case WAL_OPEN_HASHED:
+        if (acc || !(acc = ledger_alloc_account())) break;
+        acc->account_number = rec->acct_no;
+        if (rec->type == WAL_OPEN_HASHED) {
+            memcpy(acc->details->pin.salt, rec->pin_salt, sizeof(rec->pin_salt));
+            memcpy(acc->details->pin.hash, rec->pin_hash, sizeof(rec->pin_hash));
+        } else if (pin_set(&acc->details->pin, rec->value) < 0) {   // pre-hashing log
+            ledger_free_account(acc);
+            return;
+        }
+        memcpy(acc->details->name, rec->name, sizeof(acc->details->name));
+        memcpy(acc->details->nid, rec->nid, sizeof(acc->details->nid));
+        memcpy(acc->details->account_type, rec->account_type, sizeof(acc->details->account_type));
+        acc->balance = MIN_BALANCE;
+        if (index_insert(&ledger->index, rec->acct_no, acc) < 0) {
+            ledger_free_account(acc);
+            return;
+        }
+        // Never hand out a logged account number again
+        if (rec->acct_no >= atomic_load(&ledger->account_number_seed))
+            atomic_store(&ledger->account_number_seed, rec->acct_no + 1);
+        break;
+    case WAL_DEPOSIT:
+        if (!acc) return;
+        acc->balance += rec->value;
+        record_transaction(acc, TXN_DEPOSIT, rec->value);
+        break;
+    case WAL_WITHDRAW:
+        if (!acc) return;
+        acc->balance -= rec->value;
+        record_transaction(acc, TXN_WITHDRAW, rec->value);
+        break;
+    case WAL_CLOSE:
+        if (!acc) return;
+        index_remove(&ledger->index, rec->acct_no);
+        ledger_free_account(acc);
+        return;
+    }
+    if (acc) acc->last_lsn = lsn;
+}
+
+//
+// Rebuild the table from the snapshot "<wal_path>.snap" (if present) and the
+// log at `wal_path` after it, then keep logging to that log and, unless
+// `snapshot_secs` is 0, refresh the snapshot that often in the background.
+// Call after ledger_init_shared() (if used) and before serving any client;
+// in bank_server only the parent takes snapshots. Returns the number of log
+// records replayed, or -1 (errno set).
+//
+int ledger_recover(const char *wal_path, int snapshot_secs) {
+    static char snap_path[4096];
+    snprintf(snap_path, sizeof(snap_path), "%s.snap", wal_path);
+
+    uint64_t from = 0;
+    int loaded = snapshot_load(snap_path, &from);
+    if (loaded < 0) {
+        LOG_ERROR("snapshot: unusable path=%s: %m", snap_path);
+        return -1;
+    }
+    if (loaded > 0)
+        LOG_INFO("snapshot: loaded accounts=%d path=%s", loaded, snap_path);
+
+    int n = wal_replay(wal_path, from, replay_record);
+    if (n < 0 || wal_open(wal_path, ledger->shared) < 0) return -1;
+    if (snapshot_secs > 0 && snapshot_start(snap_path, snapshot_secs) < 0) return -1;
+    return n;
+}
@@ -0,0 +1,111 @@
+/*
+ * ledger.h
+ * Account table storage: process-private heap, or a MAP_SHARED region
+ * that every forked child of bank_server sees.
+ */
+
+#ifndef LEDGER_H
+#define LEDGER_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include "bankapp.h"
+#include "slab.h"
+
+// Lock striping: an account is guarded by stripe (account_number % LEDGER_STRIPES).
+// Changes to the index itself (OPEN, CLOSE, resize) take every stripe.
+#define LEDGER_STRIPES  64
+
+static inline int ledger_stripe(int acct_no) {
+    return (unsigned)acct_no % LEDGER_STRIPES;
+}
+
+// Records per slab chunk in private mode
+#define LEDGER_SLAB_CHUNK  1024
+
+// Shared mode: history chunks reserved per account of capacity (backed lazily)
+#define LEDGER_HISTORY_CHUNKS_PER_ACCOUNT  4
+
+// One lock per cache line so neighbouring stripes do not false-share
+typedef struct StripeLock {
+    pthread_mutex_t lock;
+} __attribute__((aligned(64))) StripeLock;
+
+typedef struct Ledger {
+    StripeLock      stripes[LEDGER_STRIPES];  // process-shared in shared mode
+    int             shared;
+    atomic_int      account_number_seed;
+    atomic_uint     index_seq;        // seqlock: odd while every stripe is held
+    AccountIndex    index;
+
+    // Hot Account records and their cold AccountDetails, in separate slabs so
+    // the hot ones pack densely: growable chunks, or in shared mode fixed
+    // pools in the same region
+    pthread_mutex_t pool_lock;
+    Slab            accounts;
+    Slab            details;
+    Slab            history;          // HistoryChunks of every account's history
+} Ledger;
+
+//
+// Seqlocks, for readers that take no stripe (BALANCE and STATEMENT, see
+// bankapp_network.c). A writer, already exclusive through its stripe, makes
+// the counter odd for as long as it changes what the counter guards:
+// acc->version guards the account's balance, recent entries and last_lsn;
+// ledger->index_seq guards the index and every record's generation, and is
+// odd whenever all stripes are held. A reader notes the counter, reads, and
+// starts over if it has moved; what it read before that check may be torn.
+//
+// A forked child that dies mid-change leaves its counter odd. The next
+// writer (the stripe lock is recovered from the dead child) carries on from
+// it, and until then readers give up waiting and take the lock.
+//
+#define SEQ_READ_SPINS  64   // yields a reader waits for a writer before locking
+
+static inline void seq_write_begin(atomic_uint *seq) {
+    unsigned now = atomic_load_explicit(seq, memory_order_relaxed);
+    if (!(now & 1)) atomic_store_explicit(seq, now + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void seq_write_end(atomic_uint *seq) {
+    unsigned now = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, now + 1, memory_order_release);
+}
+
+// Waits out a writer in progress; 0 if it does not finish
+static inline int seq_read_begin(atomic_uint *seq, unsigned *start) {
+    for (int i = 0; i < SEQ_READ_SPINS; i++) {
+        *start = atomic_load_explicit(seq, memory_order_acquire);
+        if (!(*start & 1)) return 1;
+        sched_yield();
+    }
+    return 0;
+}
+
+static inline int seq_read_retry(atomic_uint *seq, unsigned start) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(seq, memory_order_relaxed) != start;
+}
+
+// Points at the process-private ledger until ledger_init_shared() runs
+extern Ledger *ledger;
+
+int      ledger_init_shared(size_t capacity);
+int      ledger_recover(const char *wal_path, int snapshot_secs);
+Account *ledger_alloc_account(void);
+void     ledger_free_account(Account *acc);
+void     ledger_alloc_stats(SlabStats *out);
+long     ledger_account_count(void);
+HistoryChunk *ledger_alloc_history_chunk(void);
+void     ledger_free_history_chunk(HistoryChunk *c);
+
+void     ledger_lock_account(int acct_no);
+void     ledger_unlock_account(int acct_no);
+void     ledger_lock_pair(int acct_a, int acct_b);
+void     ledger_unlock_pair(int acct_a, int acct_b);
+void     ledger_lock_all(void);
+void     ledger_unlock_all(void);
+
+#endif // LEDGER_H
@@ -0,0 +1,253 @@
+/*
+ * log.c
+ * Leveled logging without I/O on the caller's path.
+ *
+ * Every thread that logs gets its own single-producer ring of fixed-size
+ * entries (registered once, on a lock-free list). The thread formats its
+ * message into the next free slot and publishes it by advancing `head`;
+ * the writer thread walks all rings, formats timestamps and prefixes, and
+ * hands everything it found to one write(2). The writer naps while the
+ * rings are empty, so a line reaches stderr within LOG_IDLE_NS. Lines of
+ * different threads can leave slightly out of time order; the timestamps
+ * are those of the log call.
+ *
+ * The writer does not survive fork(), and a child of a multithreaded
+ * process may not start threads of its own, so a child has none: it forgets
+ * the entries it inherited (the parent writes them), keeps queueing into its
+ * rings, and writes them out itself whenever it calls log_flush() (after
+ * each batch of replies) and at exit. At exit the writer is stopped and
+ * whatever is queued is written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "log.h"
+
+#define LOG_RING_SLOTS  256                // entries per thread
+#define LOG_TEXT_MAX    232                // longest message; longer ones are cut
+#define LOG_PREFIX_MAX  64
+#define LOG_IDLE_NS     (10 * 1000000)     // writer's nap when nothing is queued
+#define LOG_OUT_SZ      65536
+
+typedef struct LogEntry {
+    struct timespec when;
+    uint16_t len;
+    uint8_t  level;
+    char     text[LOG_TEXT_MAX];
+} LogEntry;
+
+typedef struct LogRing {
+    atomic_uint     head;                  // next slot the owning thread fills
+    atomic_uint     tail;                  // next slot the writer empties
+    atomic_ulong    dropped;               // messages lost to a full ring
+    int             id;                    // "t<id>" in the output
+    struct LogRing *next;
+    LogEntry        slot[LOG_RING_SLOTS];
+} LogRing;
+
+atomic_int log_level = LOG_LEVEL_INFO;
+
+static const char *level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+static _Atomic(LogRing *) rings;
+static atomic_int ring_count;
+static __thread LogRing *my_ring;
+
+static pthread_t  writer;
+static atomic_int queueing;                // log_start() ran: messages go to the rings
+static atomic_int running;                 // this process has a writer thread
+static atomic_int stopping;
+
+static LogRing *register_ring(void) {
+    LogRing *r = calloc(1, sizeof(LogRing));
+    if (!r) return NULL;
+    r->id = atomic_fetch_add(&ring_count, 1) + 1;
+    LogRing *head = atomic_load(&rings);
+    do r->next = head; while (!atomic_compare_exchange_weak(&rings, &head, r));
+    return r;
+}
+
+// "2026-10-17T09:30:12.123456Z DEBUG t3 "
+static size_t format_prefix(char *p, const struct timespec *when, int level, int id) {
+    struct tm tm;
+    gmtime_r(&when->tv_sec, &tm);
+    return (size_t)snprintf(p, LOG_PREFIX_MAX, "%04d-%02d-%02dT%02d:%02d:%02d.%06ldZ %-5s t%d ",
+                            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                            tm.tm_hour, tm.tm_min, tm.tm_sec, when->tv_nsec / 1000,
+                            level_names[level], id);
+}
+
+static void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDERR_FILENO, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+void log_message(int level, const char *fmt, ...) {
+    int saved_errno = errno;   // for %m
+    va_list ap;
+
+    if (!atomic_load_explicit(&queueing, memory_order_acquire)) {
+        // Not started: write it out now
+        char line[LOG_PREFIX_MAX + LOG_TEXT_MAX + 1];
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        size_t len = format_prefix(line, &now, level, 0);
+        errno = saved_errno;
+        va_start(ap, fmt);
+        int n = vsnprintf(line + len, LOG_TEXT_MAX, fmt, ap);
+        va_end(ap);
+        len += n < 0 ? 0 : n >= LOG_TEXT_MAX ? LOG_TEXT_MAX - 1 : (size_t)n;
+        line[len++] = '\n';
+        write_all(line, len);
+        return;
+    }
+
+    LogRing *r = my_ring;
+    if (!r && !(r = my_ring = register_ring())) return;
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    LogEntry *e = &r->slot[head % LOG_RING_SLOTS];
+    clock_gettime(CLOCK_REALTIME, &e->when);
+    e->level = (uint8_t)level;
+    errno = saved_errno;
+    va_start(ap, fmt);
+    int n = vsnprintf(e->text, LOG_TEXT_MAX, fmt, ap);
+    va_end(ap);
+    e->len = n < 0 ? 0 : n >= LOG_TEXT_MAX ? LOG_TEXT_MAX - 1 : (uint16_t)n;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+//
+// Write out everything queued in every ring; returns whether there was any.
+// Only the writer thread, or in a process without one log_flush() and the
+// exit handler, calls this.
+//
+static int drain_rings(void) {
+    static char out[LOG_OUT_SZ];
+    size_t len = 0;
+    int found = 0;
+
+    for (LogRing *r = atomic_load(&rings); r; r = r->next) {
+        unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            if (len + LOG_PREFIX_MAX + LOG_TEXT_MAX + 1 > sizeof(out)) {
+                write_all(out, len);
+                len = 0;
+            }
+            const LogEntry *e = &r->slot[tail % LOG_RING_SLOTS];
+            len += format_prefix(out + len, &e->when, e->level, r->id);
+            memcpy(out + len, e->text, e->len);
+            len += e->len;
+            out[len++] = '\n';
+            found = 1;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+        unsigned long dropped = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+        if (dropped) {
+            if (len + 2 * LOG_PREFIX_MAX > sizeof(out)) {
+                write_all(out, len);
+                len = 0;
+            }
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            len += format_prefix(out + len, &now, LOG_LEVEL_WARN, r->id);
+            len += (size_t)snprintf(out + len, LOG_PREFIX_MAX, "log dropped=%lu\n", dropped);
+            found = 1;
+        }
+    }
+    if (len) write_all(out, len);
+    return found;
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    int level = atomic_load(&log_level);
+    while (!atomic_load(&stopping)) {
+        // Say so when a signal changed the level
+        int now = atomic_load(&log_level);
+        if (now != level) {
+            level = now;
+            char line[2 * LOG_PREFIX_MAX];
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            size_t len = format_prefix(line, &ts, LOG_LEVEL_INFO, 0);
+            len += (size_t)snprintf(line + len, LOG_PREFIX_MAX, "log level=%s\n", level_names[level]);
+            write_all(line, len);
+        }
+        if (!drain_rings()) {
+            struct timespec nap = { 0, LOG_IDLE_NS };
+            nanosleep(&nap, NULL);
+        }
+    }
+    drain_rings();
+    return NULL;
+}
+
+static void stop_writer(void) {
+    if (atomic_load(&running)) {
+        atomic_store(&stopping, 1);
+        pthread_join(writer, NULL);
+        atomic_store(&running, 0);
+    }
+    if (atomic_load(&queueing)) drain_rings();   // anything logged since
+}
+
+static void forget_in_child(void) {
+    // Queued entries are the parent's to write
+    for (LogRing *r = atomic_load(&rings); r; r = r->next) {
+        atomic_store(&r->tail, atomic_load(&r->head));
+        atomic_store(&r->dropped, 0);
+    }
+    atomic_store(&running, 0);
+}
+
+void log_flush(void) {
+    if (!atomic_load(&running) && atomic_load(&queueing)) drain_rings();
+}
+
+// SIGUSR1: one level more verbose; SIGUSR2: one level quieter
+static void on_level_signal(int sig) {
+    int level = atomic_load(&log_level);
+    if (sig == SIGUSR1 && level < LOG_LEVEL_DEBUG) atomic_store(&log_level, level + 1);
+    if (sig == SIGUSR2 && level > LOG_LEVEL_ERROR) atomic_store(&log_level, level - 1);
+}
+
+int log_start(int level) {
+    atomic_store(&log_level, level);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_level_signal;
+    sa.sa_flags   = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) return -1;
+    atomic_store(&running, 1);
+    atomic_store(&queueing, 1);
+    pthread_atfork(NULL, NULL, forget_in_child);
+    atexit(stop_writer);
+    return 0;
+}
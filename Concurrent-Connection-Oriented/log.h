@@ -0,0 +1,57 @@
+/*
+ * log.h
+ * Leveled logging: per-thread lock-free rings drained by a writer thread
+ *
+ * LOG_DEBUG(...) and friends take a printf format (%m included); by
+ * convention the message names the event or subsystem first and carries
+ * values as key=value fields, e.g.
+ *
+ *     LOG_DEBUG("deposit acct=%d amount=%d balance=%d", acct, amount, bal);
+ *
+ * and comes out on stderr as "<UTC time> <LEVEL> t<thread> <message>".
+ * A message above the current level costs one relaxed load and a branch, so
+ * DEBUG tracing stays compiled in. An enabled one is formatted into the
+ * calling thread's ring, never blocking on I/O or on other threads; if the
+ * ring is full it is dropped and counted. Before log_start() (or in programs
+ * that never call it) messages are written synchronously instead.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+
+enum LogLevel {
+    LOG_LEVEL_ERROR = 0,
+    LOG_LEVEL_WARN  = 1,
+    LOG_LEVEL_INFO  = 2,
+    LOG_LEVEL_DEBUG = 3,
+};
+
+extern atomic_int log_level;   // messages above this level are discarded
+
+#define LOG_AT(level, ...)                                                        \
+    do {                                                                          \
+        if (__builtin_expect((level) <= atomic_load_explicit(&log_level,          \
+                                                             memory_order_relaxed), 0)) \
+            log_message((level), __VA_ARGS__);                                    \
+    } while (0)
+
+#define LOG_ERROR(...)  LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)   LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...)   LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...)  LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+void log_message(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Start the writer thread at `level`; SIGUSR1 / SIGUSR2 then raise / lower
+// the level of the process that receives them (forked children keep their
+// own copy of the level). Returns 0, or -1 if no thread.
+int  log_start(int level);
+
+// In a forked child, which has no writer thread, write out what it has
+// queued; elsewhere a no-op. Call where a write(2) is acceptable, e.g.
+// once a batch of replies has gone out.
+void log_flush(void);
+
+#endif // LOG_H
@@ -0,0 +1,315 @@
+/*
+ * metrics.c
+ * Per-thread metric shards in a shared mapping, and their two renderings.
+ *
+ * A thread claims a free shard the first time it records and keeps it; a
+ * forked child hands its shard back at exit and the next child carries on
+ * counting in it. Each shard notes the pid that claimed it, so a child that
+ * dies any other way has its shard freed by the parent when it reaps it.
+ * When every shard is taken the request is only counted as unrecorded. Readers sum the shards without locking, so a reading can miss
+ * the requests being recorded at that moment.
+ *
+ * Histograms are large (histogram.h), but a shard's histogram for a command
+ * is only touched once that command has been seen on that thread, so unused
+ * shards and commands cost address space, not memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include "metrics.h"
+#include "command_processor.h"
+#include "histogram.h"
+#include "log.h"
+
+#define METRICS_MAX_GAUGES  8
+
+typedef struct MetricShard {
+    atomic_int owner;                // pid of the claiming process, 0 if free
+    uint64_t   calls[CMD_COUNT];
+    uint64_t   errors[CMD_COUNT];
+    Histogram  latency[CMD_COUNT];   // ns
+} MetricShard;
+
+typedef struct MetricsRegion {
+    atomic_long  connections;
+    atomic_ulong unrecorded;         // requests that found no free shard
+    int          nshards;
+    MetricShard  shard[];
+} MetricsRegion;
+
+typedef struct Gauge {
+    const char *name;
+    const char *help;
+    long      (*read)(void);
+} Gauge;
+
+// A command's totals over all shards
+typedef struct CommandTotals {
+    uint64_t calls, errors, sum_ns, max_ns;
+    uint64_t p50_ns, p99_ns, p999_ns;
+} CommandTotals;
+
+static MetricsRegion *region;
+static __thread MetricShard *my_shard;
+static Gauge gauges[METRICS_MAX_GAUGES];
+static int   ngauges;
+static int   serve_fd = -1;
+
+int metrics_init(int shards) {
+    size_t size = sizeof(MetricsRegion) + (size_t)shards * sizeof(MetricShard);
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) return -1;
+    region = p;
+    region->nshards = shards;
+    return 0;
+}
+
+uint64_t metrics_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static MetricShard *claim_shard(void) {
+    int pid = (int)getpid();
+    for (int i = 0; i < region->nshards; i++) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&region->shard[i].owner, &expected, pid))
+            return &region->shard[i];
+    }
+    return NULL;
+}
+
+void metrics_record(int cmd, int failed, uint64_t start_ns) {
+    if (!region) return;
+    MetricShard *s = my_shard;
+    if (!s && !(s = my_shard = claim_shard())) {
+        atomic_fetch_add_explicit(&region->unrecorded, 1, memory_order_relaxed);
+        return;
+    }
+    s->calls[cmd]++;
+    if (failed) s->errors[cmd]++;
+    hist_record(&s->latency[cmd], metrics_clock() - start_ns);
+}
+
+void metrics_release(void) {
+    if (!my_shard) return;
+    atomic_store(&my_shard->owner, 0);
+    my_shard = NULL;
+}
+
+// Only atomics: safe in a SIGCHLD handler
+void metrics_reap(pid_t pid) {
+    if (!region) return;
+    for (int i = 0; i < region->nshards; i++) {
+        int expected = (int)pid;
+        atomic_compare_exchange_strong(&region->shard[i].owner, &expected, 0);
+    }
+}
+
+void metrics_connection_opened(void) {
+    if (region) atomic_fetch_add_explicit(&region->connections, 1, memory_order_relaxed);
+}
+
+void metrics_connection_closed(void) {
+    if (region) atomic_fetch_sub_explicit(&region->connections, 1, memory_order_relaxed);
+}
+
+void metrics_add_gauge(const char *name, const char *help, long (*read)(void)) {
+    if (ngauges < METRICS_MAX_GAUGES)
+        gauges[ngauges++] = (Gauge){ .name = name, .help = help, .read = read };
+}
+
+//
+// Add up every shard. One scratch histogram is reused per command, and a
+// shard's histogram is only read if that shard has seen the command.
+//
+static int collect(CommandTotals *t) {
+    memset(t, 0, CMD_COUNT * sizeof(CommandTotals));
+    if (!region) return 0;
+    Histogram *h = malloc(sizeof(Histogram));
+    if (!h) return -1;
+    for (int c = 0; c < CMD_COUNT; c++) {
+        hist_reset(h);
+        for (int i = 0; i < region->nshards; i++) {
+            const MetricShard *s = &region->shard[i];
+            if (!s->calls[c]) continue;
+            t[c].calls  += s->calls[c];
+            t[c].errors += s->errors[c];
+            hist_merge(h, &s->latency[c]);
+        }
+        t[c].sum_ns  = h->sum;
+        t[c].max_ns  = h->max;
+        t[c].p50_ns  = hist_percentile(h, 50.0);
+        t[c].p99_ns  = hist_percentile(h, 99.0);
+        t[c].p999_ns = hist_percentile(h, 99.9);
+    }
+    free(h);
+    return 0;
+}
+
+// snprintf that stops at `cap` instead of running past it
+#define APPEND(...) \
+    (len += (size_t)snprintf(out + len, len < cap ? cap - len : 0, __VA_ARGS__), \
+     len = len < cap ? len : cap)
+
+size_t metrics_format_stats(char *out, size_t cap, int *lines) {
+    CommandTotals t[CMD_COUNT];
+    size_t len = 0;
+    *lines = 0;
+    if (cap) out[0] = '\0';
+    if (collect(t) < 0) return 0;
+
+    for (int c = 0; c < CMD_COUNT; c++) {
+        if (!t[c].calls) continue;
+        APPEND("%s calls=%llu errors=%llu p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f\n",
+               command_name(c), (unsigned long long)t[c].calls,
+               (unsigned long long)t[c].errors, t[c].p50_ns / 1e3,
+               t[c].p99_ns / 1e3, t[c].p999_ns / 1e3, t[c].max_ns / 1e3);
+        ++*lines;
+    }
+    APPEND("connections_active=%ld\n", region ? atomic_load(&region->connections) : 0);
+    ++*lines;
+    for (int g = 0; g < ngauges; g++) {
+        APPEND("%s=%ld\n", gauges[g].name, gauges[g].read());
+        ++*lines;
+    }
+    return len;
+}
+
+size_t metrics_format_prometheus(char *out, size_t cap) {
+    CommandTotals t[CMD_COUNT];
+    size_t len = 0;
+    if (cap) out[0] = '\0';
+    if (collect(t) < 0) return 0;
+
+    APPEND("# HELP bank_requests_total Requests handled, by command.\n"
+           "# TYPE bank_requests_total counter\n");
+    for (int c = 0; c < CMD_COUNT; c++)
+        APPEND("bank_requests_total{command=\"%s\"} %llu\n",
+               command_name(c), (unsigned long long)t[c].calls);
+
+    APPEND("# HELP bank_request_errors_total Requests answered with an error, by command.\n"
+           "# TYPE bank_request_errors_total counter\n");
+    for (int c = 0; c < CMD_COUNT; c++)
+        APPEND("bank_request_errors_total{command=\"%s\"} %llu\n",
+               command_name(c), (unsigned long long)t[c].errors);
+
+    APPEND("# HELP bank_request_duration_seconds Time from parsing a request to queuing its reply.\n"
+           "# TYPE bank_request_duration_seconds summary\n");
+    for (int c = 0; c < CMD_COUNT; c++) {
+        if (!t[c].calls) continue;
+        const char *name = command_name(c);
+        APPEND("bank_request_duration_seconds{command=\"%s\",quantile=\"0.5\"} %.9f\n"
+               "bank_request_duration_seconds{command=\"%s\",quantile=\"0.99\"} %.9f\n"
+               "bank_request_duration_seconds{command=\"%s\",quantile=\"0.999\"} %.9f\n"
+               "bank_request_duration_seconds_sum{command=\"%s\"} %.9f\n"
+               "bank_request_duration_seconds_count{command=\"%s\"} %llu\n",
+               name, t[c].p50_ns / 1e9, name, t[c].p99_ns / 1e9, name, t[c].p999_ns / 1e9,
+               name, t[c].sum_ns / 1e9, name, (unsigned long long)t[c].calls);
+    }
+
+    APPEND("# HELP bank_requests_unrecorded_total Requests not counted: every metrics shard was taken.\n"
+           "# TYPE bank_requests_unrecorded_total counter\n"
+           "bank_requests_unrecorded_total %lu\n",
+           region ? atomic_load(&region->unrecorded) : 0);
+    APPEND("# HELP bank_connections_active Client connections being served.\n"
+           "# TYPE bank_connections_active gauge\n"
+           "bank_connections_active %ld\n",
+           region ? atomic_load(&region->connections) : 0);
+    for (int g = 0; g < ngauges; g++)
+        APPEND("# HELP bank_%s %s\n# TYPE bank_%s gauge\nbank_%s %ld\n",
+               gauges[g].name, gauges[g].help, gauges[g].name, gauges[g].name,
+               gauges[g].read());
+    return len;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//
+// Minimal HTTP: whatever the request, answer with the metrics and close.
+// Scrapes are rare, so one connection at a time is plenty; a receive
+// timeout keeps a silent client from holding up the next scrape.
+//
+static void *serve_main(void *arg) {
+    int listen_fd = (int)(intptr_t)arg;
+    char *body = malloc(METRICS_TEXT_MAX);
+    if (!body) return NULL;
+
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            LOG_WARN("metrics: accept: %m");
+            continue;
+        }
+        struct timeval timeout = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char req[1024];
+        if (read(fd, req, sizeof(req)) > 0) {
+            size_t len = metrics_format_prometheus(body, METRICS_TEXT_MAX);
+            char head[160];
+            int hlen = snprintf(head, sizeof(head),
+                                "HTTP/1.0 200 OK\r\n"
+                                "Content-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: %zu\r\n\r\n", len);
+            if (write_all(fd, head, hlen) < 0 || write_all(fd, body, len) < 0)
+                LOG_DEBUG("metrics: write: %m");
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+// Forked children do not serve scrapes; nor may they keep the port bound
+static void close_in_child(void) {
+    close(serve_fd);
+    serve_fd = -1;
+}
+
+int metrics_serve(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, serve_main, (void*)(intptr_t)fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    pthread_detach(tid);
+    serve_fd = fd;
+    pthread_atfork(NULL, NULL, close_in_child);
+    return 0;
+}
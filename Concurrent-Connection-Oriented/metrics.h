@@ -0,0 +1,58 @@
+/*
+ * metrics.h
+ * Request counters, latency histograms and gauges, read by the STATS command
+ * and by a Prometheus text endpoint on a port of its own
+ *
+ * Every thread that serves requests records into a shard of its own (no
+ * locks, no shared cache lines); readers add the shards up. The shards live
+ * in one MAP_SHARED region so a forking server's children all report into
+ * the parent's view. A request is timed from the start of its parsing to
+ * its reply being queued: the wait for the log and the socket write are not
+ * included.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define METRICS_DEFAULT_PORT  9333
+#define METRICS_TEXT_MAX      16384   // longest rendering of either format
+
+// Room for `shards` recording threads (or, forking, concurrent children).
+// Until this runs nothing is recorded.
+int  metrics_init(int shards);
+
+// Monotonic nanoseconds, the start time metrics_record() expects
+uint64_t metrics_clock(void);
+
+// Count one request of `cmd` (enum Command, command_processor.h), failed or
+// not, that started at `start_ns`
+void metrics_record(int cmd, int failed, uint64_t start_ns);
+
+// A forked child gives its shard back before it exits; the counts stay
+void metrics_release(void);
+
+// The parent frees whatever shard child `pid` still held once it has reaped
+// it, however the child ended. Async-signal-safe.
+void metrics_reap(pid_t pid);
+
+void metrics_connection_opened(void);
+void metrics_connection_closed(void);
+
+// Report `read()` as gauge `name` (exported as bank_<name>)
+void metrics_add_gauge(const char *name, const char *help, long (*read)(void));
+
+// STATS body: one "<COMMAND> calls=.. errors=.. p50_us=.." line per command
+// seen so far, then one "<gauge>=<value>" line per gauge; *lines is the count
+size_t metrics_format_stats(char *out, size_t cap, int *lines);
+
+// Prometheus text exposition format (version 0.0.4)
+size_t metrics_format_prometheus(char *out, size_t cap);
+
+// Serve the Prometheus format over HTTP on `port` from a thread of its own
+int  metrics_serve(int port);
+
+#endif // METRICS_H
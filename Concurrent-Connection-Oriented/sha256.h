@@ -0,0 +1,24 @@
+/*
+ * sha256.h
+ * Minimal SHA-256 (FIPS 180-4), enough to hash PINs without a crypto library
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_LEN  32
+
+typedef struct Sha256 {
+    uint32_t state[8];
+    uint64_t bytes;          // message length so far
+    uint8_t  block[64];      // partial block
+} Sha256;
+
+void sha256_init(Sha256 *s);
+void sha256_update(Sha256 *s, const void *data, size_t len);
+void sha256_final(Sha256 *s, uint8_t out[SHA256_LEN]);
+
+#endif // SHA256_H
@@ -0,0 +1,36 @@
+/*
+ * slab.h
+ * Fixed-size object allocator: contiguous chunks carved in order, freed
+ * objects recycled through a LIFO free list
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+typedef struct SlabStats {
+    size_t live;          // objects handed out and not yet freed
+    size_t free;          // carved objects waiting on the free list
+    size_t high_water;    // most objects ever live at once
+    size_t capacity;      // objects backed by memory (carved or not)
+    size_t chunks;        // regions obtained from the system
+} SlabStats;
+
+typedef struct Slab {
+    size_t obj_size;      // at least a pointer: the free-list link overlays the object
+    size_t chunk_objs;    // objects per chunk when the slab grows
+    char  *bump;          // next never-used object in the newest chunk
+    char  *bump_end;
+    void  *free_list;
+    int    fixed;         // one caller-provided region; never grows
+    SlabStats stats;
+} Slab;
+
+// Not thread-safe: callers serialise (the ledger uses its pool_lock)
+void  slab_init(Slab *s, size_t obj_size, size_t chunk_objs);
+void  slab_init_fixed(Slab *s, size_t obj_size, void *region, size_t count);
+void *slab_alloc(Slab *s);
+void  slab_free(Slab *s, void *obj);
+
+#endif // SLAB_H
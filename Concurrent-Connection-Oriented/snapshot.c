@@ -0,0 +1,301 @@
+/*
+ * snapshot.c
+ * Background snapshots of the account table, and loading them at startup.
+ *
+ * A snapshot is fuzzy: it is written while requests keep running, one lock
+ * stripe at a time, so it is not a picture of a single instant. It does not
+ * need to be. It notes the durable log position S before it starts, and
+ * every record carries the LSN of its account's last logged change. Any
+ * change logged before S is already in the copy (the change was applied under the stripe
+ * lock the snapshot later took). Replaying the log from S, with records at or
+ * below an account's last_lsn skipped, rebuilds exactly the live table.
+ *
+ * One unlocked pass over the index first sorts the account numbers by
+ * stripe; each stripe is then held just long enough to copy its own
+ * accounts, while requests on the other 63 proceed. Holding a stripe also
+ * freezes the index (OPEN and CLOSE need all of them), so the lookups made
+ * under it are exact. Each account's full history is flattened into the
+ * file after its record and re-chained on load, so a snapshot's size and
+ * the time to write it grow with all the history ever recorded.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "ledger.h"
+#include "wal.h"
+#include "log.h"
+
+// Unmap a snapshot that cannot be loaded; returns -1 with errno = err
+static int reject(char *base, size_t size, int err) {
+    munmap(base, size);
+    errno = err;
+    return -1;
+}
+
+// The header's crc field must match the rest of the file
+static int checksum_ok(const char *base, size_t size) {
+    SnapshotHeader h;
+    memcpy(&h, base, sizeof(h));
+    uint32_t want = h.crc;
+    h.crc = 0;
+    uint32_t crc = wal_crc32(0, base + sizeof(h), size - sizeof(h));
+    return wal_crc32(crc, &h, sizeof(h)) == want;
+}
+
+//
+// Map the snapshot at `path` and load its records into the (empty) ledger.
+// Sets *log_lsn to where log replay must resume. Returns the number of
+// accounts loaded, 0 if there is no snapshot, or -1 if it is unusable.
+// Nothing in the file is trusted before the checksum passes, and each
+// record is bounds-checked against the mapping before it is read.
+//
+int snapshot_load(const char *path, uint64_t *log_lsn) {
+    *log_lsn = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    // Read-only, private: pages stream in as the loops below touch them
+    char *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    const SnapshotHeader *h = (const SnapshotHeader*)base;
+    uint64_t body = st.st_size - sizeof(SnapshotHeader);
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 ||
+        h->record_size != sizeof(SnapshotRecord) ||
+        !checksum_ok(base, st.st_size) ||
+        h->count > body / sizeof(SnapshotRecord) ||
+        h->history_count > body / sizeof(Transaction) ||
+        body != h->count * sizeof(SnapshotRecord) + h->history_count * sizeof(Transaction))
+        return reject(base, st.st_size, EINVAL);
+
+    const char *p   = base + sizeof(SnapshotHeader);
+    const char *end = base + st.st_size;
+    for (uint64_t i = 0; i < h->count; i++) {
+        if ((size_t)(end - p) < sizeof(SnapshotRecord)) return reject(base, st.st_size, EINVAL);
+        const SnapshotRecord *rec = (const SnapshotRecord*)p;
+        p += sizeof(SnapshotRecord);
+        uint32_t entry_count = rec->details.history.count;
+        if (entry_count > (size_t)(end - p) / sizeof(Transaction))
+            return reject(base, st.st_size, EINVAL);
+        const Transaction *entries = (const Transaction*)p;
+        p += entry_count * sizeof(Transaction);
+
+        Account *acc = ledger_alloc_account();
+        if (!acc) return reject(base, st.st_size, ENOMEM);
+        AccountDetails *d = acc->details;
+        *acc = rec->hot;
+        *d   = rec->details;
+        acc->details = d;
+        d->history = (History){ 0 };
+        for (uint32_t e = 0; e < entry_count; e++) {
+            if (history_append(&d->history, entries[e]) < 0)
+                return reject(base, st.st_size, ENOMEM);
+        }
+        if (index_insert(&ledger->index, acc->account_number, acc) < 0)
+            return reject(base, st.st_size, ENOMEM);
+    }
+    atomic_store(&ledger->account_number_seed, h->next_account);
+    *log_lsn = h->log_lsn;
+    int count = (int)h->count;
+    munmap(base, st.st_size);
+    return count;
+}
+
+#define BUCKET_TRIES  4   // unlocked index passes before taking every stripe
+
+// Account numbers of each stripe, from the last bucket_accounts()
+static int    *bucket[LEDGER_STRIPES];
+static size_t  bucket_len[LEDGER_STRIPES];
+static size_t  bucket_cap[LEDGER_STRIPES];
+
+static int bucket_add(int key) {
+    unsigned s = (unsigned)key % LEDGER_STRIPES;
+    if (bucket_len[s] == bucket_cap[s]) {
+        size_t cap = bucket_cap[s] ? bucket_cap[s] * 2 : 1024;
+        int *grown = realloc(bucket[s], cap * sizeof(int));
+        if (!grown) return -1;
+        bucket[s] = grown;
+        bucket_cap[s] = cap;
+    }
+    bucket[s][bucket_len[s]++] = key;
+    return 0;
+}
+
+//
+// Sort every account number in the index into its stripe's bucket with one
+// pass that takes no lock. OPEN and CLOSE hold every stripe, so index_seq
+// tells whether one overlapped the pass; if so it is redone, and after
+// BUCKET_TRIES attempts it runs under ledger_lock_all() instead. Accounts
+// opened or closed after the pass are logged after the snapshot's log
+// position, so replay settles them. Returns 0, or -1 if out of memory.
+//
+static int bucket_accounts(void) {
+    for (int attempt = 0; ; attempt++) {
+        unsigned start = 0;
+        int locked = attempt >= BUCKET_TRIES;
+        if (locked) ledger_lock_all();
+        else if (!seq_read_begin(&ledger->index_seq, &start)) continue;
+
+        memset(bucket_len, 0, sizeof(bucket_len));
+        size_t capacity = __atomic_load_n(&ledger->index.capacity, __ATOMIC_ACQUIRE);
+        const IndexSlot *slots = __atomic_load_n(&ledger->index.slots, __ATOMIC_ACQUIRE);
+        int rc = 0;
+        for (size_t i = 0; i < capacity && rc == 0; i++) {
+            int key = __atomic_load_n(&slots[i].key, __ATOMIC_RELAXED);
+            if (key != 0) rc = bucket_add(key);
+        }
+        if (locked) {
+            ledger_unlock_all();
+            return rc;
+        }
+        if (rc < 0) return -1;
+        if (!seq_read_retry(&ledger->index_seq, start)) return 0;
+    }
+}
+
+//
+// Write a fresh snapshot next to `path` and atomically rename it into place.
+// Returns 0, or -1 (errno set) and the previous snapshot stays valid.
+//
+int snapshot_write(const char *path) {
+    static SnapshotRecord *copy;   // one stripe's worth of records
+    static size_t   copy_cap;
+    static Transaction *hist;      // ... and of their history entries
+    static size_t   hist_cap;
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return -1;
+
+    SnapshotHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.record_size = sizeof(SnapshotRecord);
+    // The durable position, not the appended one: bytes past it may never
+    // reach the file, and the offsets would then be reused by new records
+    h.log_lsn     = wal_durable_lsn();
+    fwrite(&h, sizeof(h), 1, f);   // placeholder until count is known
+    if (bucket_accounts() < 0) {
+        fclose(f);
+        unlink(tmp);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint64_t newest = 0;
+    uint32_t crc = 0;   // of the records, in file order
+    for (int s = 0; s < LEDGER_STRIPES; s++) {
+        size_t n = 0, nh = 0;
+        ledger_lock_account(s);
+        for (size_t b = 0; b < bucket_len[s]; b++) {
+            const Account *acc = index_lookup(&ledger->index, bucket[s][b]);
+            if (!acc) continue;   // closed since the pass
+            const History *hs = &acc->details->history;
+            if (n == copy_cap || nh + hs->count > hist_cap) {
+                size_t cap  = n == copy_cap ? (copy_cap ? copy_cap * 2 : 1024) : copy_cap;
+                size_t hcap = hist_cap ? hist_cap : 4096;
+                while (hcap < nh + hs->count) hcap *= 2;
+                SnapshotRecord *grown = realloc(copy, cap * sizeof(SnapshotRecord));
+                if (grown) copy = grown, copy_cap = cap;
+                Transaction *hgrown = grown ? realloc(hist, hcap * sizeof(Transaction)) : NULL;
+                if (hgrown) hist = hgrown, hist_cap = hcap;
+                if (!hgrown) {
+                    ledger_unlock_account(s);
+                    fclose(f);
+                    unlink(tmp);
+                    errno = ENOMEM;
+                    return -1;
+                }
+            }
+            copy[n].hot     = *acc;
+            copy[n].details = *acc->details;
+            nh += history_read(hs, 0, hs->count, hist + nh);
+            n++;
+        }
+        ledger_unlock_account(s);
+
+        const Transaction *entries = hist;
+        for (size_t i = 0; i < n; i++) {
+            if (copy[i].hot.last_lsn > newest) newest = copy[i].hot.last_lsn;
+            uint32_t cnt = copy[i].details.history.count;
+            fwrite(&copy[i], sizeof(SnapshotRecord), 1, f);
+            fwrite(entries, sizeof(Transaction), cnt, f);
+            crc = wal_crc32(crc, &copy[i], sizeof(SnapshotRecord));
+            crc = wal_crc32(crc, entries, cnt * sizeof(Transaction));
+            entries += cnt;
+        }
+        h.count += n;
+        h.history_count += nh;
+    }
+    h.next_account = atomic_load(&ledger->account_number_seed);
+    h.crc = wal_crc32(crc, &h, sizeof(h));
+
+    // Never let the snapshot get ahead of the durable log: it may hold
+    // changes whose replies are still waiting on a group commit
+    wal_wait_durable(newest);
+
+    if (fseek(f, 0, SEEK_SET) < 0 || fwrite(&h, sizeof(h), 1, f) != 1 ||
+        fflush(f) != 0 || fsync(fileno(f)) < 0) {
+        int err = errno;
+        fclose(f);
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    if (fclose(f) != 0 || rename(tmp, path) < 0) {
+        int err = errno;
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct SnapshotJob {
+    const char *path;
+    int         interval;
+} SnapshotJob;
+
+static void *snapshot_main(void *arg) {
+    SnapshotJob *job = arg;
+    uint64_t last = wal_durable_lsn();
+    while (1) {
+        sleep(job->interval);
+        uint64_t now = wal_durable_lsn();
+        if (now == last) continue;   // nothing committed since the last one
+        if (snapshot_write(job->path) < 0) LOG_ERROR("snapshot: write failed path=%s: %m", job->path);
+        else last = now;
+    }
+    return NULL;
+}
+
+//
+// Snapshot the ledger to `path` every `interval_secs` seconds from a
+// detached background thread. Returns 0, or -1 if the thread cannot start.
+//
+int snapshot_start(const char *path, int interval_secs) {
+    static SnapshotJob job;
+    job.path     = path;
+    job.interval = interval_secs;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, snapshot_main, &job) != 0) return -1;
+    pthread_detach(tid);
+    return 0;
+}
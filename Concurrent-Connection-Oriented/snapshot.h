@@ -0,0 +1,43 @@
+/*
+ * snapshot.h
+ * Fixed-record image of the account table, so startup only replays the
+ * write-ahead log written after it
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include "bankapp.h"
+
+#define SNAPSHOT_MAGIC    "BANKSNP4"
+#define SNAPSHOT_DEFAULT_INTERVAL  60   // seconds between background snapshots
+
+// File layout: one header, then `count` SnapshotRecords, each followed by
+// its account's full history (details.history.count Transactions, oldest
+// first). Records are the raw hot and cold structs (mini-statement ring and
+// last_lsn included; the details and history pointers are meaningless on
+// disk), so a file is only readable by a build with the same layout;
+// record_size guards against that. A file whose crc does not match is
+// rejected as a whole.
+typedef struct SnapshotHeader {
+    char     magic[8];
+    uint32_t record_size;     // sizeof(SnapshotRecord) of the writer
+    uint32_t crc;             // CRC-32 of everything after the header, then of the header with crc = 0
+    uint64_t count;
+    uint64_t log_lsn;         // replay the log from here
+    int32_t  next_account;    // account_number_seed when the snapshot ended
+    int32_t  reserved2;
+    uint64_t history_count;   // history entries in the file, all accounts
+} SnapshotHeader;
+
+typedef struct SnapshotRecord {
+    Account        hot;
+    AccountDetails details;
+} SnapshotRecord;
+
+int snapshot_load(const char *path, uint64_t *log_lsn);
+int snapshot_write(const char *path);
+int snapshot_start(const char *path, int interval_secs);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,334 @@
+/*
+ * wal.c
+ * Write-ahead log: every ledger mutation is appended here, and its reply is
+ * only sent once the record is on disk.
+ *
+ * Records are staged in one of two in-memory buffers. Nobody syncs on their
+ * own behalf: a thread that needs durability and finds no flush in progress
+ * becomes the leader, swaps the staging buffers, and write()s + fdatasync()s
+ * everything appended so far with the lock dropped. Requests arriving in the
+ * meantime stage into the other buffer and wait; the next leader commits all
+ * of them with a single fdatasync(). The busier the server, the more records
+ * each sync covers.
+ *
+ * LSNs are byte offsets into the log: a record's LSN is where it ends, so
+ * "durable >= lsn" means the record is on disk.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wal.h"
+#include "log.h"
+
+Wal *wal = NULL;
+
+static __thread uint64_t dependency_lsn;
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const void *data, size_t len) {
+    return wal_crc32(0, data, len);
+}
+
+//
+// CRC-32 (IEEE) of `data`, continuing a running value `crc` (0 to start),
+// so a file can be checksummed as it is written. Snapshots use it too.
+//
+uint32_t wal_crc32(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&crc_once, crc_init);
+    const unsigned char *p = data;
+    uint32_t c = crc ^ 0xFFFFFFFFu;
+    while (len--) c = crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static size_t record_len(int type) {
+    return type == WAL_OPEN_HASHED ? sizeof(WalRecord)
+         : type == WAL_OPEN     ? WAL_PLAIN_OPEN_RECORD
+         : type == WAL_TRANSFER ? WAL_TRANSFER_RECORD
+         : WAL_SMALL_RECORD;
+}
+
+static int valid_record(const WalRecord *rec, size_t avail) {
+    if (avail < WAL_SMALL_RECORD) return 0;
+    if (rec->type < WAL_OPEN || rec->type > WAL_OPEN_HASHED) return 0;
+    if (rec->len != record_len(rec->type) || rec->len > avail) return 0;
+    return rec->crc == crc32((const char*)rec + sizeof(rec->crc), rec->len - sizeof(rec->crc));
+}
+
+//
+// Feed every intact record of the log at `path` that ends after `from_lsn`
+// (a snapshot's position, or 0) to apply(), in order. A torn or corrupt tail
+// (a crash mid-append) ends the log: it is truncated away so new records
+// follow the last good one. A missing log is an empty one. Returns the
+// number of records applied, or -1 on I/O error or a log that is shorter
+// than `from_lsn`.
+//
+int wal_replay(const char *path, uint64_t from_lsn,
+               void (*apply)(const WalRecord *rec, uint64_t lsn)) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        if (errno == ENOENT && from_lsn == 0) return 0;
+        return -1;
+    }
+    if (lseek(fd, from_lsn, SEEK_SET) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    static char chunk[WAL_BUF_SZ];
+    size_t have = 0;
+    uint64_t offset = from_lsn;   // file offset of chunk[0]
+    int applied = 0, eof = 0;
+    while (1) {
+        // Refill behind the unconsumed bytes
+        while (!eof && have < sizeof(chunk)) {
+            ssize_t n = read(fd, chunk + have, sizeof(chunk) - have);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                close(fd);
+                return -1;
+            }
+            if (n == 0) eof = 1;
+            have += n;
+        }
+
+        size_t pos = 0;
+        WalRecord rec;
+        while (1) {
+            size_t avail = have - pos;
+            memset(&rec, 0, sizeof(rec));
+            memcpy(&rec, chunk + pos, avail < sizeof(rec) ? avail : sizeof(rec));
+            if (!valid_record(&rec, avail)) break;
+            pos += rec.len;
+            apply(&rec, offset + pos);
+            applied++;
+        }
+        offset += pos;
+        memmove(chunk, chunk + pos, have - pos);
+        have -= pos;
+
+        if (eof) break;
+        if (pos == 0) break;   // a full chunk without one valid record: corrupt
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < from_lsn) {
+        close(fd);
+        errno = EINVAL;   // the snapshot is ahead of the log it came from
+        return -1;
+    }
+    if ((uint64_t)st.st_size > offset) {
+        LOG_WARN("wal: discarding torn log tail bytes=%llu",
+                 (unsigned long long)(st.st_size - offset));
+        if (ftruncate(fd, offset) < 0 || fdatasync(fd) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return applied;
+}
+
+static int init_shared_sync(Wal *w) {
+    pthread_mutexattr_t ma;
+    pthread_mutexattr_init(&ma);
+    pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+    int rc = pthread_mutex_init(&w->lock, &ma);
+    pthread_mutexattr_destroy(&ma);
+    if (rc != 0) return rc;
+
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+    rc = pthread_cond_init(&w->changed, &ca);
+    pthread_condattr_destroy(&ca);
+    return rc;
+}
+
+//
+// Open (creating if needed) the log for appending. With `shared` the control
+// block and staging buffers live in a MAP_SHARED mapping, so forked children
+// commit through one log. Returns 0, or -1 with errno set.
+//
+int wal_open(const char *path, int shared) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    Wal *w;
+    if (shared) {
+        w = mmap(NULL, sizeof(Wal), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (w == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        int rc = init_shared_sync(w);
+        if (rc != 0) {
+            munmap(w, sizeof(Wal));
+            close(fd);
+            errno = rc;
+            return -1;
+        }
+    } else {
+        w = calloc(1, sizeof(Wal));
+        if (!w) {
+            close(fd);
+            return -1;
+        }
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->changed, NULL);
+    }
+
+    w->fd       = fd;
+    w->appended = st.st_size;
+    w->durable  = st.st_size;
+    w->syncing  = 0;
+    w->active   = 0;
+    w->buf_len[0] = w->buf_len[1] = 0;
+    wal = w;
+    return 0;
+}
+
+static void lock_wal(void) {
+    if (pthread_mutex_lock(&wal->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&wal->lock);
+}
+
+static void wait_changed(void) {
+    if (pthread_cond_wait(&wal->changed, &wal->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&wal->lock);
+}
+
+//
+// Called with the lock held and no flush in progress. Commits everything
+// appended so far; returns with the lock held again.
+//
+static void lead_flush(void) {
+    int idx = wal->active;
+    size_t len = wal->buf_len[idx];
+    uint64_t target = wal->appended;
+    wal->syncing = 1;
+    wal->active  = idx ^ 1;   // the other buffer was emptied by the previous leader
+    pthread_mutex_unlock(&wal->lock);
+
+    const char *p = wal->buf[idx];
+    size_t left = len;
+    while (left > 0) {
+        ssize_t n = write(wal->fd, p, left);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("wal: write");
+            abort();   // cannot acknowledge anything any more
+        }
+        p += n;
+        left -= n;
+    }
+    if (len > 0 && fdatasync(wal->fd) < 0) {
+        perror("wal: fdatasync");
+        abort();
+    }
+
+    lock_wal();
+    wal->buf_len[idx] = 0;
+    wal->durable = target;
+    wal->syncing = 0;
+    pthread_cond_broadcast(&wal->changed);
+}
+
+//
+// Stage one record (crc and len are filled in here) and return its LSN.
+// Usually just a memcpy under the lock; only when 1 MiB is already waiting
+// does the caller have to help flush. Returns 0 when no log is open.
+//
+uint64_t wal_append(WalRecord *rec) {
+    return wal_append_many(rec, 1);
+}
+
+//
+// Stage n records back to back under one acquisition of the log lock and
+// return the LSN of the last. The records are contiguous in the log.
+//
+uint64_t wal_append_many(WalRecord *recs, int n) {
+    if (!wal || n == 0) return 0;
+    for (int i = 0; i < n; i++) {
+        WalRecord *rec = &recs[i];
+        rec->len = record_len(rec->type);
+        rec->reserved = 0;
+        rec->crc = crc32((const char*)rec + sizeof(rec->crc), rec->len - sizeof(rec->crc));
+    }
+
+    lock_wal();
+    for (int i = 0; i < n; i++) {
+        const WalRecord *rec = &recs[i];
+        while (wal->buf_len[wal->active] + rec->len > WAL_BUF_SZ) {
+            if (wal->syncing) wait_changed();
+            else lead_flush();
+        }
+        memcpy(wal->buf[wal->active] + wal->buf_len[wal->active], rec, rec->len);
+        wal->buf_len[wal->active] += rec->len;
+        wal->appended += rec->len;
+    }
+    uint64_t lsn = wal->appended;
+    pthread_mutex_unlock(&wal->lock);
+
+    wal_note_dependency(lsn);
+    return lsn;
+}
+
+//
+// Block until every record up to `lsn` is on disk, leading a group commit if
+// no other thread is already doing one.
+//
+void wal_wait_durable(uint64_t lsn) {
+    if (!wal || lsn == 0) return;
+    lock_wal();
+    while (wal->durable < lsn) {
+        if (wal->syncing) wait_changed();
+        else lead_flush();
+    }
+    pthread_mutex_unlock(&wal->lock);
+}
+
+uint64_t wal_durable_lsn(void) {
+    if (!wal) return 0;
+    lock_wal();
+    uint64_t lsn = wal->durable;
+    pthread_mutex_unlock(&wal->lock);
+    return lsn;
+}
+
+//
+// A reply may only leave once everything it reveals is durable: the request's
+// own records, and the last change to every account it read.
+//
+void wal_note_dependency(uint64_t lsn) {
+    if (lsn > dependency_lsn) dependency_lsn = lsn;
+}
+
+uint64_t wal_take_dependency(void) {
+    uint64_t lsn = dependency_lsn;
+    dependency_lsn = 0;
+    return lsn;
+}
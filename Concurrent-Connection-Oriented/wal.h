@@ -0,0 +1,77 @@
+/*
+ * wal.h
+ * Append-only write-ahead log of ledger mutations, with group commit
+ */
+
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define WAL_BUF_SZ  (1 << 20)   // per staging buffer; two alternate
+
+enum WalType {
+    WAL_OPEN     = 1,
+    WAL_DEPOSIT  = 2,
+    WAL_WITHDRAW = 3,
+    WAL_CLOSE    = 4,
+    WAL_TRANSFER = 5,
+    WAL_OPEN_HASHED = 6,     // WAL_OPEN carrying the PIN's salt and hash
+};
+
+// On-disk record (host byte order; the log is not meant to move between
+// architectures). crc covers every byte after the crc field.
+typedef struct WalRecord {
+    uint32_t crc;
+    uint16_t len;            // bytes actually stored: header + used body
+    uint8_t  type;
+    uint8_t  reserved;
+    int32_t  acct_no;        // the debited account for WAL_TRANSFER
+    int32_t  value;          // amount, or the plaintext PIN of an old WAL_OPEN
+    union {
+        struct {             // WAL_OPEN_HASHED (WAL_OPEN: up to account_type)
+            char name[50];
+            char nid[20];
+            char account_type[10];
+            uint8_t pin_salt[16];
+            uint8_t pin_hash[32];
+        };
+        int32_t to_acct;     // WAL_TRANSFER: the credited account
+    };
+} WalRecord;
+
+#define WAL_SMALL_RECORD     offsetof(WalRecord, name)
+#define WAL_TRANSFER_RECORD  (WAL_SMALL_RECORD + sizeof(int32_t))
+#define WAL_PLAIN_OPEN_RECORD  offsetof(WalRecord, pin_salt)
+
+typedef struct Wal {
+    pthread_mutex_t lock;          // process-shared when the ledger is
+    pthread_cond_t  changed;       // durable advanced, or a flush finished
+    int             fd;
+    uint64_t        appended;      // LSN (log byte offset) of the last appended record
+    uint64_t        durable;       // everything below this is on disk
+    int             syncing;       // a leader is writing + fdatasync'ing
+    int             active;        // staging buffer new records go to
+    size_t          buf_len[2];
+    char            buf[2][WAL_BUF_SZ];
+} Wal;
+
+// NULL when running without a log
+extern Wal *wal;
+
+int      wal_replay(const char *path, uint64_t from_lsn,
+                    void (*apply)(const WalRecord *rec, uint64_t lsn));
+int      wal_open(const char *path, int shared);
+uint64_t wal_append(WalRecord *rec);
+uint64_t wal_append_many(WalRecord *recs, int n);
+void     wal_wait_durable(uint64_t lsn);
+uint64_t wal_durable_lsn(void);
+uint32_t wal_crc32(uint32_t crc, const void *data, size_t len);
+
+// Per-thread commit dependency of the request being processed
+void     wal_note_dependency(uint64_t lsn);
+uint64_t wal_take_dependency(void);
+
+#endif // WAL_H
@@ -0,0 +1,73 @@
+/*
+ * work_queue.c
+ * Bounded MPMC queue for the thread-pool server.
+ *
+ * wq_try_push() never blocks: a full queue is reported to the caller, which
+ * can shed the load instead of letting a storm pile up unbounded work.
+ * wq_push() waits for room instead, for work that must not be dropped.
+ * Consumers sleep on a condition variable until an item arrives.
+ */
+
+#include <stdlib.h>
+#include "work_queue.h"
+
+int wq_init(WorkQueue *q, int capacity) {
+    q->items = malloc(capacity * sizeof(void *));
+    if (!q->items) return -1;
+    q->capacity = capacity;
+    q->head     = 0;
+    q->count    = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+// Caller holds q->lock and the queue has room
+static void put(WorkQueue *q, void *item) {
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+}
+
+// Returns 0 if queued, -1 if the queue is full
+int wq_try_push(WorkQueue *q, void *item) {
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->capacity) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+    put(q, item);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+// Blocks until there is room
+void wq_push(WorkQueue *q, void *item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    put(q, item);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Blocks until an item is available
+void *wq_pop(WorkQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    void *item = q->items[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+// Items waiting right now
+int wq_depth(WorkQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    int count = q->count;
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
@@ -0,0 +1,27 @@
+/*
+ * work_queue.h
+ * Bounded multi-producer / multi-consumer queue of pointers (ready connections)
+ */
+
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <pthread.h>
+
+typedef struct WorkQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+    void          **items;      // ring buffer
+    int             capacity;
+    int             head;       // next item to pop
+    int             count;
+} WorkQueue;
+
+int   wq_init(WorkQueue *q, int capacity);
+int   wq_try_push(WorkQueue *q, void *item);
+void  wq_push(WorkQueue *q, void *item);
+void *wq_pop(WorkQueue *q);
+int   wq_depth(WorkQueue *q);
+
+#endif // WORK_QUEUE_H